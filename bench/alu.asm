@@ -0,0 +1,17 @@
+; Tight ALU loop: ADD, AND and NOT between registers, no memory traffic
+        .ORIG x3000
+        LD R5, OUTER
+OLOOP   LD R4, INNER
+ILOOP   ADD R1, R1, R4
+        AND R2, R1, #7
+        ADD R3, R3, R2
+        NOT R3, R3
+        ADD R1, R1, R3
+        ADD R4, R4, #-1
+        BRp ILOOP
+        ADD R5, R5, #-1
+        BRp OLOOP
+        HALT
+OUTER   .FILL #1000
+INNER   .FILL #10000
+        .END
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Runs the LC-3 workloads in bench/ on lc3-vm and reports guest MIPS.
+
+Every workload is assembled, then run --runs times under each engine, pinned to one CPU. The
+time is the one lc3-vm reports with --stats: the guest run only, without process start up or
+image loading. The results go to --out as tab separated values, one line per workload and
+engine, and a summary is printed.
+
+usage: bench.py [--vm ./lc3-vm] [--engines switch,threaded,...] [--runs 5] [--cpu 0]
+                [--out bench_output.txt] [workload ...]
+"""
+import argparse
+import glob
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, BENCH_DIR)
+import lc3as  # noqa: E402
+
+ENGINES = ['switch', 'threaded', 'decoded', 'block', 'jit', 'table']
+
+
+def poll_input(path):
+    """The keyboard for poll.asm: 4MB of text."""
+    line = b'the quick brown fox jumps over the lazy dog 0123456789\n'
+    with open(path, 'wb') as f:
+        f.write(line * ((4 << 20) // len(line)))
+
+
+# Workloads that read the keyboard, everything else gets /dev/null
+INPUTS = {'poll': poll_input}
+
+
+def pin(cpu):
+    def pin_child():
+        try:
+            os.sched_setaffinity(0, {cpu})
+        except (AttributeError, OSError):
+            pass
+    return pin_child
+
+
+def run_once(vm, engine, image, keyboard, cpu, options=()):
+    """Returns (instructions, seconds), or None if the vm does not have the engine."""
+    with open(keyboard, 'rb') as stdin:
+        result = subprocess.run([vm, '--stats', '--engine=' + engine] + list(options) + [image],
+                                stdin=stdin,
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                                preexec_fn=pin(cpu))
+    if result.returncode == 2 and b'Unknown engine' in result.stdout:
+        return None
+    if result.returncode != 0:
+        raise RuntimeError('%s exited with %d under %s' % (image, result.returncode, engine))
+    stats = dict(line.split(': ', 1) for line in result.stderr.decode().splitlines() if ': ' in line)
+    return int(stats['instructions']), float(stats['seconds'])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--vm', default='./lc3-vm')
+    parser.add_argument('--engines', default=','.join(ENGINES))
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--cpu', type=int, default=0, help='CPU to pin the runs to')
+    parser.add_argument('--out', default='bench_output.txt')
+    parser.add_argument('workloads', nargs='*',
+                        help='names of bench/*.asm files, all of them by default')
+    args = parser.parse_args()
+
+    workloads = args.workloads or sorted(os.path.basename(p)[:-4]
+                                         for p in glob.glob(os.path.join(BENCH_DIR, '*.asm')))
+    rows = []
+    with tempfile.TemporaryDirectory() as build:
+        for name in workloads:
+            image = os.path.join(build, name + '.obj')
+            lc3as.assemble_file(os.path.join(BENCH_DIR, name + '.asm'), image)
+            keyboard = os.devnull
+            if name in INPUTS:
+                keyboard = os.path.join(build, name + '.in')
+                INPUTS[name](keyboard)
+
+            for engine in args.engines.split(','):
+                # One run first to warm the caches, not counted
+                if run_once(args.vm, engine, image, keyboard, args.cpu) is None:
+                    sys.stderr.write('%s does not have the %s engine, skipped\n' % (args.vm, engine))
+                    continue
+                samples = [run_once(args.vm, engine, image, keyboard, args.cpu)
+                           for _ in range(args.runs)]
+                instructions = samples[0][0]
+                if any(n != instructions for n, _ in samples):
+                    raise RuntimeError('%s ran a different number of instructions across runs' % name)
+                seconds = [t for _, t in samples]
+                median = statistics.median(seconds)
+                variance = statistics.variance(seconds) if len(seconds) > 1 else 0.0
+                rows.append((name, engine, len(seconds), instructions, median, variance,
+                             instructions / median / 1e6, median * 1e9 / instructions))
+
+    with open(args.out, 'w') as f:
+        f.write('workload\tengine\truns\tinstructions\tmedian_s\tvariance_s2\tmips\tns_per_instruction\n')
+        for row in rows:
+            f.write('%s\t%s\t%d\t%d\t%.6f\t%.3e\t%.1f\t%.3f\n' % row)
+
+    print('%-12s %-9s %12s %10s %9s %9s %8s' % ('workload', 'engine', 'instructions', 'median (s)',
+                                               'MIPS', 'ns/instr', 'cv (%)'))
+    for name, engine, runs, instructions, median, variance, mips, ns in rows:
+        print('%-12s %-9s %12d %10.4f %9.1f %9.3f %8.2f' % (name, engine, instructions, median, mips,
+                                                           ns, 100 * variance ** 0.5 / median))
+    print('\nwritten to %s' % args.out)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""Compares the lc3-vm engines: cost per opcode class and final machine state.
+
+For each opcode class a micro-kernel is generated: a counted loop whose body is the instruction
+under test repeated UNROLL times. An empty loop is timed as well, and what it costs per iteration
+is taken off every kernel, so what is left divided by the instructions under test is the cost of
+one of them. Times come from --stats as in bench.py.
+
+Every kernel, and every workload in bench/, is also run once per engine with
+--save-snapshot-at-halt. The snapshots must be identical byte for byte: registers, condition
+codes, instruction count and all of memory. Any difference is listed and the exit status is 1.
+
+usage: engines.py [--vm ./lc3-vm] [--engines switch,threaded,...] [--runs 3] [--cpu 0]
+                  [--out bench_engines.txt]
+"""
+import argparse
+import glob
+import os
+import statistics
+import struct
+import sys
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, BENCH_DIR)
+import bench  # noqa: E402
+import lc3as  # noqa: E402
+
+UNROLL = 32
+INNER = 1000
+
+# name: (instruction under test, instructions per unit, setup, data, outer iterations)
+# The loop counters are R4 and R5, and the flags are positive whenever the body starts.
+KERNELS = [
+    ('loop', ('', 1, '', '', 250)),
+    ('ADD', ('ADD R1, R1, #1', 1, '', '', 250)),
+    ('AND', ('AND R2, R1, R3', 1, '', '', 250)),
+    ('NOT', ('NOT R1, R1', 1, '', '', 250)),
+    ('LEA', ('LEA R2, DATA', 1, '', '', 250)),
+    ('LD', ('LD R1, DATA', 1, '', '', 250)),
+    ('LDR', ('LDR R1, R6, #0', 1, 'LEA R6, DATA', '', 250)),
+    ('LDI', ('LDI R1, POINTER', 1, '', 'POINTER .FILL DATA', 250)),
+    ('ST', ('ST R1, DATA', 1, '', '', 250)),
+    ('STR', ('STR R1, R6, #0', 1, 'LEA R6, DATA', '', 250)),
+    ('BR taken', ('BRnzp #0', 1, '', '', 250)),
+    ('BR not taken', ('BRz #0', 1, '', '', 250)),
+    ('JSR+RET', ('JSR LEAF', 2, '', 'LEAF RET', 125)),
+    ('TRAP OUT', ('OUT', 1, 'LD R0, DOT', 'DOT .FILL x2E', 25)),
+]
+
+
+def kernel_source(body, setup, data, outer):
+    return '\n'.join([
+        '        .ORIG x3000',
+        '        ' + setup,
+        '        LD R5, OUTER',
+        'OLOOP   LD R4, INNER',
+        'ILOOP',
+        ] + ['        ' + body] * (UNROLL if body else 0) + [
+        '        ADD R4, R4, #-1',
+        '        BRp ILOOP',
+        '        ADD R5, R5, #-1',
+        '        BRp OLOOP',
+        '        HALT',
+        'OUTER   .FILL #%d' % outer,
+        'INNER   .FILL #%d' % INNER,
+        'DATA    .FILL x1234',
+        data,
+        '        .END',
+        ''])
+
+
+# Mirrors struct snapshot_header in lc3-vm.c, in host byte order
+REGISTERS = ['R0', 'R1', 'R2', 'R3', 'R4', 'R5', 'R6', 'R7', 'PC', 'COND']
+HEADER = struct.Struct('=8sII%dH4xQ' % len(REGISTERS))
+
+
+def read_snapshot(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    fields = HEADER.unpack_from(data)
+    memory_at = fields[2]
+    return fields[3:3 + len(REGISTERS)], fields[-1], data[memory_at:]
+
+
+def differences(expected, actual):
+    """Lists what differs between two snapshots, at most a few memory words."""
+    (reg_a, count_a, mem_a), (reg_b, count_b, mem_b) = expected, actual
+    out = ['%s x%04X != x%04X' % (r, a, b) for r, a, b in zip(REGISTERS, reg_a, reg_b) if a != b]
+    if count_a != count_b:
+        out.append('instructions %d != %d' % (count_a, count_b))
+    words_a = struct.unpack('=%dH' % (len(mem_a) // 2), mem_a)
+    words_b = struct.unpack('=%dH' % (len(mem_b) // 2), mem_b)
+    changed = [i for i, (a, b) in enumerate(zip(words_a, words_b)) if a != b]
+    out += ['memory[x%04X] x%04X != x%04X' % (i, words_a[i], words_b[i]) for i in changed[:4]]
+    if len(changed) > 4:
+        out.append('and %d more words' % (len(changed) - 4))
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--vm', default='./lc3-vm')
+    parser.add_argument('--engines', default=','.join(bench.ENGINES))
+    parser.add_argument('--runs', type=int, default=3)
+    parser.add_argument('--cpu', type=int, default=0, help='CPU to pin the runs to')
+    parser.add_argument('--out', default='bench_engines.txt')
+    args = parser.parse_args()
+
+    engines = args.engines.split(',')
+    times = {}          # (kernel, engine): median seconds
+    snapshots = {}      # program: {engine: snapshot}
+    with tempfile.TemporaryDirectory() as build:
+        programs = []
+        for name, (body, per_unit, setup, data, outer) in KERNELS:
+            source = os.path.join(build, 'kernel-%d.asm' % len(programs))
+            with open(source, 'w') as f:
+                f.write(kernel_source(body, setup, data, outer))
+            programs.append((name, source, os.devnull, True))
+        for path in sorted(glob.glob(os.path.join(BENCH_DIR, '*.asm'))):
+            name = os.path.basename(path)[:-4]
+            keyboard = os.devnull
+            if name in bench.INPUTS:
+                keyboard = os.path.join(build, name + '.in')
+                bench.INPUTS[name](keyboard)
+            programs.append((name, path, keyboard, False))
+
+        for name, source, keyboard, timed in programs:
+            image = os.path.join(build, 'image.obj')
+            lc3as.assemble_file(source, image)
+            snapshots[name] = {}
+            for engine in list(engines):
+                # The first run, not timed, leaves the final state behind
+                snapshot = os.path.join(build, engine + '.snap')
+                if bench.run_once(args.vm, engine, image, keyboard, args.cpu,
+                                  ['--save-snapshot-at-halt=' + snapshot]) is None:
+                    sys.stderr.write('%s does not have the %s engine, skipped\n' % (args.vm, engine))
+                    engines.remove(engine)
+                    continue
+                snapshots[name][engine] = read_snapshot(snapshot)
+                if timed:
+                    times[name, engine] = statistics.median(
+                        bench.run_once(args.vm, engine, image, keyboard, args.cpu)[1]
+                        for _ in range(args.runs))
+
+    # ns per instruction under test, the empty loop taken off in proportion to the iterations
+    costs = {}
+    base_outer = dict(KERNELS)['loop'][4]
+    for name, (body, per_unit, setup, data, outer) in KERNELS[1:]:
+        units = outer * INNER * UNROLL
+        for engine in engines:
+            overhead = times['loop', engine] * outer / base_outer
+            costs[name, engine] = max(times[name, engine] - overhead, 0.0) * 1e9 / (units * per_unit)
+
+    with open(args.out, 'w') as f:
+        f.write('class\t' + '\t'.join(engines) + '\n')
+        for name, _ in KERNELS[1:]:
+            f.write(name + '\t' + '\t'.join('%.3f' % costs[name, e] for e in engines) + '\n')
+
+    print('ns per instruction (JSR+RET: per instruction of the pair)\n')
+    print('%-13s' % 'class' + ''.join('%10s' % e for e in engines) + '   fastest')
+    for name, _ in KERNELS[1:]:
+        fastest = min(engines, key=lambda e: costs[name, e])
+        print('%-13s' % name + ''.join('%10.3f' % costs[name, e] for e in engines) + '   ' + fastest)
+
+    mismatches = 0
+    print('\nfinal state against %s:' % engines[0])
+    for name, by_engine in snapshots.items():
+        expected = by_engine[engines[0]]
+        bad = [(e, differences(expected, by_engine[e])) for e in engines[1:]]
+        bad = [(e, d) for e, d in bad if d]
+        print('  %-13s %s' % (name, 'differs' if bad else 'identical'))
+        for engine, lines in bad:
+            mismatches += 1
+            for line in lines:
+                print('      %s: %s' % (engine, line))
+    print('\nwritten to %s' % args.out)
+    return 1 if mismatches else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Ranks instruction pairs and triples for superinstruction fusion from an lc3-vm --profile report.
+
+The report lists the hottest blocks: runs of consecutive words executed the same number of times.
+The words of each block are read back from the image and every pair and triple of neighbouring
+instructions in it is counted as often as the block ran. Instructions are named after the decoded
+engine's ids (ADD_IMM, LDR, BR, ...). A sequence can be fused when only its last instruction ends
+a block in the block engine, and those are marked with a *.
+
+The opcodes, the decoded ids, how decode_instruction() picks them and which ones end a block are
+read from lc3-vm.c, so the names always match the vm being tuned.
+
+With --emit n, the first n fusable pairs and triples are printed as FUSION_PAIRS and
+FUSION_TRIPLES lines for lc3-vm.c. Names with a RAM-only variant (an enum decoded_ids entry with
+a _RAM suffix, see ram_access_id()) are listed in both forms.
+
+usage: fusion.py report.txt image.obj [more.obj ...] [--source lc3-vm.c] [--top 15] [--emit n]
+"""
+import argparse
+import collections
+import os
+import re
+import struct
+import sys
+
+SOURCE = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))), 'lc3-vm.c')
+
+
+def enum_names(source, first):
+    """The names in the C enum whose first entry is first, in order."""
+    for body in re.findall(r'enum\s*\w*\s*\{(.*?)\}', source, re.S):
+        body = re.sub(r'//.*', '', body)
+        names = re.findall(r'^\s*(\w+)', body, re.M)
+        if names and names[0] == first:
+            return names
+    raise ValueError('no enum starting with %s' % first)
+
+
+def function_body(source, signature):
+    start = source.index(signature)
+    return source[start:source.index('\n}\n', start)]
+
+
+class Decoder:
+    """What lc3-vm.c does with an instruction word: its decoded id and whether it ends a block."""
+
+    def __init__(self, path):
+        with open(path) as f:
+            source = f.read()
+        try:
+            opcodes = enum_names(source, 'OP_BR')
+            self.ids = {name[2:] for name in enum_names(source, 'D_UNDECODED')}
+            # case OP_ADD: d->id = ((instruction >> 5) & 0x1) ? D_ADD_IMM : D_ADD_REG;
+            decode = function_body(source, 'void decode_instruction(')
+            self.by_opcode = []
+            for opcode in opcodes:
+                case = decode[decode.index('case %s:' % opcode):]
+                picked = re.search(r'd->id = (?:\(\(instruction >> (\d+)\) & 0x1\) \? D_(\w+) : )?D_(\w+);',
+                                   case.split('break;')[0])
+                bit, set_id, clear_id = picked.groups()
+                self.by_opcode.append((int(bit) if bit else None, set_id, clear_id))
+            self.ends_block = set(re.findall(r'case D_(\w+):',
+                                             function_body(source, 'int ends_block(int id)')))
+        except (ValueError, AttributeError) as e:
+            sys.exit('could not read the decoder from %s: %s' % (path, e))
+
+    def name(self, word):
+        """The enum decoded_ids name decode_instruction() picks for the word, without the D_."""
+        bit, set_id, clear_id = self.by_opcode[word >> 12]
+        return set_id if bit is not None and word >> bit & 1 else clear_id
+
+    def fusable(self, sequence):
+        return (all(name not in self.ends_block for name in sequence[:-1]) and
+                sequence[-1] not in ('RTI', 'RES'))
+
+    def variants(self, sequence):
+        """Every combination of plain and _RAM names for the sequence."""
+        out = [()]
+        for name in sequence:
+            forms = [name, name + '_RAM'] if name + '_RAM' in self.ids else [name]
+            out = [s + (f,) for s in out for f in forms]
+        return out
+
+
+def read_image(path, memory):
+    with open(path, 'rb') as f:
+        data = f.read()
+    origin, = struct.unpack_from('>H', data)
+    words = struct.unpack_from('>%dH' % ((len(data) - 2) // 2), data, 2)
+    for i, word in enumerate(words[:0x10000 - origin]):
+        memory[origin + i] = word
+
+
+def read_blocks(path):
+    """Returns the instruction total and (start, length, runs) for every block in the report."""
+    total, blocks = 0, []
+    with open(path) as f:
+        for line in f:
+            m = re.match(r'profile: (\d+) instructions', line)
+            if m:
+                total = int(m.group(1))
+            m = re.match(r'x([0-9A-F]{4})-x([0-9A-F]{4})\s+\d+\s+[\d.]+\s+(\d+)\s+(\d+)', line)
+            if m:
+                blocks.append((int(m.group(1), 16), int(m.group(4)), int(m.group(3))))
+    return total, blocks
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('report')
+    parser.add_argument('images', nargs='+')
+    parser.add_argument('--source', default=SOURCE, help='lc3-vm.c to read the decoder from')
+    parser.add_argument('--top', type=int, default=15, help='sequences listed of each length')
+    parser.add_argument('--emit', type=int, default=0,
+                        help='fusable sequences of each length to print for lc3-vm.c')
+    args = parser.parse_args()
+
+    decoder = Decoder(args.source)
+    memory = [0] * 0x10000
+    for image in args.images:
+        read_image(image, memory)
+    total, blocks = read_blocks(args.report)
+    if not blocks:
+        sys.exit('%s has no blocks, is it a --profile report?' % args.report)
+
+    counts = {2: collections.Counter(), 3: collections.Counter()}
+    covered = 0
+    for start, length, runs in blocks:
+        names = [decoder.name(memory[(start + i) & 0xFFFF]) for i in range(length)]
+        covered += length * runs
+        for n, counter in counts.items():
+            for i in range(length - n + 1):
+                counter[tuple(names[i:i + n])] += runs
+
+    print('%d blocks, %d of %d instructions (%.1f%%)\n' % (
+        len(blocks), covered, total, 100.0 * covered / total if total else 0))
+    for n, counter in counts.items():
+        print('%-32s %14s %8s' % ('pairs' if n == 2 else 'triples', 'executed', '%'))
+        for sequence, count in counter.most_common(args.top):
+            print('%-32s %14d %8.2f' % (('* ' if decoder.fusable(sequence) else '  ') + ' + '.join(sequence),
+                                         count, 100.0 * count * n / total if total else 0))
+        print()
+
+    if args.emit:
+        for n, macro in ((2, 'FUSION_PAIRS'), (3, 'FUSION_TRIPLES')):
+            chosen = [s for s, _ in counts[n].most_common() if decoder.fusable(s)][:args.emit]
+            lines = ['    X(%s)' % ', '.join(v) for s in chosen for v in decoder.variants(s)]
+            print('#define %s(X) \\\n%s' % (macro, ' \\\n'.join(lines)))
+            print()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""Minimal LC-3 assembler: writes a big-endian .obj image and a .sym table."""
+import re
+import struct
+import sys
+
+OPS = {'ADD': 1, 'AND': 5, 'NOT': 9, 'LD': 2, 'ST': 3, 'LDI': 10, 'STI': 11,
+       'LDR': 6, 'STR': 7, 'LEA': 14, 'JMP': 12, 'RET': 12, 'JSR': 4, 'JSRR': 4,
+       'TRAP': 15, 'RTI': 8}
+TRAPS = {'GETC': 0x20, 'OUT': 0x21, 'PUTS': 0x22, 'IN': 0x23, 'PUTSP': 0x24, 'HALT': 0x25}
+
+
+def tokens(line):
+    line = line.split(';', 1)[0]
+    out, cur, quote = [], '', False
+    for ch in line:
+        if quote:
+            cur += ch
+            if ch == '"' and not cur.endswith('\\"'):
+                quote = False
+        elif ch == '"':
+            quote, cur = True, cur + ch
+        elif ch in ' \t,':
+            if cur:
+                out.append(cur)
+            cur = ''
+        else:
+            cur += ch
+    if cur:
+        out.append(cur)
+    return out
+
+
+def is_op(tok):
+    t = tok.upper()
+    return t in OPS or t in TRAPS or t.startswith('.') or re.fullmatch(r'BRN?Z?P?', t) is not None
+
+
+def number(tok):
+    t = tok.upper().lstrip('#')
+    if t.startswith('X') or t.startswith('-X'):
+        neg = t.startswith('-')
+        v = int(t.lstrip('-')[1:], 16)
+        return -v if neg else v
+    if t.startswith('B'):
+        return int(t[1:], 2)
+    return int(t)
+
+
+def size(toks):
+    op = toks[0].upper()
+    if op == '.BLKW':
+        return number(toks[1])
+    if op == '.STRINGZ':
+        return len(unescape(' '.join(toks[1:]))) + 1
+    if op in ('.ORIG', '.END'):
+        return 0
+    return 1
+
+
+def unescape(s):
+    s = s.strip()[1:-1]
+    return s.encode().decode('unicode_escape')
+
+
+def assemble(src):
+    lines = [tokens(l) for l in src.splitlines()]
+    symbols, pc, origin = {}, None, None
+    for toks in lines:
+        if not toks:
+            continue
+        if not is_op(toks[0]):
+            symbols[toks[0].upper()] = pc
+            toks = toks[1:]
+            if not toks:
+                continue
+        if toks[0].upper() == '.ORIG':
+            origin = pc = number(toks[1])
+            continue
+        if toks[0].upper() == '.END':
+            break
+        pc += size(toks)
+
+    words, pc = [], origin
+
+    def reg(t):
+        return int(t.upper()[1])
+
+    def val(t, bits, rel=True):
+        if t.upper() in symbols:
+            v = symbols[t.upper()] - (pc + 1) if rel else symbols[t.upper()]
+        else:
+            v = number(t)
+        lo, hi = -(1 << (bits - 1)), (1 << bits) - 1
+        if not lo <= v <= hi:
+            raise ValueError('value %s out of range at x%04X' % (t, pc))
+        return v & ((1 << bits) - 1)
+
+    for toks in lines:
+        if not toks:
+            continue
+        if not is_op(toks[0]):
+            toks = toks[1:]
+            if not toks:
+                continue
+        op, args = toks[0].upper(), toks[1:]
+        if op == '.ORIG':
+            continue
+        if op == '.END':
+            break
+        if op == '.FILL':
+            a = args[0]
+            words.append((symbols[a.upper()] if a.upper() in symbols else number(a)) & 0xFFFF)
+        elif op == '.BLKW':
+            words.extend([0] * number(args[0]))
+        elif op == '.STRINGZ':
+            words.extend(ord(c) for c in unescape(' '.join(args)))
+            words.append(0)
+        elif op in TRAPS:
+            words.append(0xF000 | TRAPS[op])
+        elif op == 'TRAP':
+            words.append(0xF000 | (number(args[0]) & 0xFF))
+        elif op.startswith('BR'):
+            cond = 0
+            flags = op[2:] or 'NZP'
+            for c, b in (('N', 4), ('Z', 2), ('P', 1)):
+                if c in flags:
+                    cond |= b
+            words.append((cond << 9) | val(args[0], 9))
+        elif op in ('ADD', 'AND'):
+            w = (OPS[op] << 12) | (reg(args[0]) << 9) | (reg(args[1]) << 6)
+            if args[2].upper().startswith('R') and len(args[2]) == 2:
+                w |= reg(args[2])
+            else:
+                w |= 0x20 | val(args[2], 5, rel=False)
+            words.append(w)
+        elif op == 'NOT':
+            words.append(0x903F | (reg(args[0]) << 9) | (reg(args[1]) << 6))
+        elif op in ('LD', 'ST', 'LDI', 'STI', 'LEA'):
+            words.append((OPS[op] << 12) | (reg(args[0]) << 9) | val(args[1], 9))
+        elif op in ('LDR', 'STR'):
+            words.append((OPS[op] << 12) | (reg(args[0]) << 9) | (reg(args[1]) << 6) | val(args[2], 6, rel=False))
+        elif op == 'JMP':
+            words.append(0xC000 | (reg(args[0]) << 6))
+        elif op == 'RET':
+            words.append(0xC1C0)
+        elif op == 'JSR':
+            words.append(0x4800 | val(args[0], 11))
+        elif op == 'JSRR':
+            words.append(0x4000 | (reg(args[0]) << 6))
+        elif op == 'RTI':
+            words.append(0x8000)
+        else:
+            raise ValueError('unknown op ' + op)
+        pc = origin + len(words)
+    return origin, words, symbols
+
+
+def assemble_file(asm_path, obj_path):
+    """Writes obj_path and the symbol table next to it, the .obj extension replaced by .sym."""
+    with open(asm_path) as f:
+        origin, words, symbols = assemble(f.read())
+    with open(obj_path, 'wb') as f:
+        f.write(struct.pack('>H', origin))
+        f.write(struct.pack('>%dH' % len(words), *words))
+    sym_path = re.sub(r'\.obj$', '', obj_path) + '.sym'
+    with open(sym_path, 'w') as f:
+        f.write('// Symbol table\n// Scope level 0:\n')
+        f.write('//\tSymbol Name       Page Address\n//\t----------------  ------------\n')
+        for name, addr in sorted(symbols.items(), key=lambda kv: kv[1]):
+            f.write('//\t%-16s  %04X\n' % (name, addr))
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.stderr.write('usage: lc3as.py input.asm output.obj\n')
+        sys.exit(2)
+    assemble_file(sys.argv[1], sys.argv[2])
+
+
+if __name__ == '__main__':
+    main()
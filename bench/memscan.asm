@@ -0,0 +1,21 @@
+; Memory bound scan: LDR/STR read-modify-write passes over a 4096 word array
+        .ORIG x3000
+        LD R5, PASSES
+PASS    LD R6, ARRAYP
+        LD R4, LENGTH
+SCAN    LDR R1, R6, #0
+        ADD R1, R1, R5
+        STR R1, R6, #0
+        LDR R2, R6, #1
+        ADD R3, R3, R2
+        ADD R6, R6, #2
+        ADD R4, R4, #-1
+        BRp SCAN
+        ADD R5, R5, #-1
+        BRp PASS
+        HALT
+PASSES  .FILL #4000
+LENGTH  .FILL #2048
+ARRAYP  .FILL ARRAY
+ARRAY   .BLKW #4096
+        .END
@@ -0,0 +1,25 @@
+; Trap heavy output: a PUTS and 60 OUTs per line, 200000 lines
+        .ORIG x3000
+        LD R6, PAGES
+PAGE    LD R5, LINES
+LINE    LEA R0, TEXT
+        PUTS
+        LD R4, CHARS
+        LD R0, DOT
+CHAR    OUT
+        ADD R4, R4, #-1
+        BRp CHAR
+        LD R0, NEWLINE
+        OUT
+        ADD R5, R5, #-1
+        BRp LINE
+        ADD R6, R6, #-1
+        BRp PAGE
+        HALT
+PAGES   .FILL #10
+LINES   .FILL #20000
+CHARS   .FILL #60
+DOT     .FILL x2E
+NEWLINE .FILL x0A
+TEXT    .STRINGZ "line of output: "
+        .END
@@ -0,0 +1,15 @@
+; Keyboard polling: reads every key through KBSR/KBDR until the input runs out, bench.py feeds it
+;  a few MB of text
+        .ORIG x3000
+        AND R3, R3, #0
+POLL    LDI R1, KBSR
+        BRzp POLL
+        LDI R0, KBDR
+        ADD R2, R0, #1          ; KBDR reads xFFFF at the end of input
+        BRz DONE
+        ADD R3, R3, R0
+        BRnzp POLL
+DONE    HALT
+KBSR    .FILL xFE00
+KBDR    .FILL xFE02
+        .END
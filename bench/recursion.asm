@@ -0,0 +1,34 @@
+; Call heavy recursion: naive Fibonacci, saving registers on a stack in R6
+        .ORIG x3000
+        LD R5, REPEAT
+AGAIN   LD R6, STACK
+        LD R0, N
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp AGAIN
+        HALT
+REPEAT  .FILL #30
+N       .FILL #24
+STACK   .FILL xF000
+
+; R1 = fib(R0), every other register is preserved
+FIB     ADD R6, R6, #-3
+        STR R7, R6, #0
+        STR R0, R6, #1
+        STR R2, R6, #2
+        ADD R1, R0, #-2
+        BRn BASE
+        ADD R0, R0, #-1
+        JSR FIB
+        ADD R2, R1, #0
+        ADD R0, R0, #-1
+        JSR FIB
+        ADD R1, R1, R2
+        BRnzp DONE
+BASE    ADD R1, R0, #0
+DONE    LDR R0, R6, #1
+        LDR R2, R6, #2
+        LDR R7, R6, #0
+        ADD R6, R6, #3
+        RET
+        .END
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Writes lc3-handlers.h: one handler for each of the 65536 LC-3 instruction words.
+
+Every handler has the register numbers and the sign extended immediate or offset of its word
+baked in as constants, so the table engine dispatches with handler_table[instruction](vm) and
+never decodes a field. The bodies do what the operation functions in lc3-vm.c do, with the PC
+already pointing past the instruction. Words that behave the same share one handler: BR with no
+condition bits, NOT with any low bits, and every RTI, RES and unknown trap.
+
+usage: gen_handlers.py > lc3-handlers.h
+"""
+import sys
+
+TRAPS = {0x20: 'trap_getc(vm);', 0x21: 'trap_out(vm);', 0x22: 'trap_puts(vm);',
+         0x23: 'trap_in(vm);', 0x24: 'trap_putsp(vm);', 0x25: 'trap_halt(vm);'}
+
+
+def sext(value, bits):
+    return value - (1 << bits) if value & (1 << (bits - 1)) else value
+
+
+def plus(value):
+    """value as a C term to add, e.g. '+ 3' or '- 1'."""
+    return '- %d' % -value if value < 0 else '+ %d' % value
+
+
+def body(word):
+    """The C statements for the instruction word."""
+    op = word >> 12
+    dr = (word >> 9) & 0x7
+    sr1 = (word >> 6) & 0x7
+    sr2 = word & 0x7
+    imm5 = sext(word & 0x1F, 5)
+    off6 = sext(word & 0x3F, 6)
+    off9 = sext(word & 0x1FF, 9)
+    off11 = sext(word & 0x7FF, 11)
+    pc_off9 = 'vm->reg[R_PC] %s' % plus(off9)
+    flags = 'update_flags(vm, %d);' % dr
+
+    if op == 0x0:       # BR
+        if dr == 0:
+            return ['(void)CHECKPOINT(vm);']
+        jump = 'vm->reg[R_PC] = %s;' % pc_off9
+        if dr == 0x7:
+            return [jump, '(void)CHECKPOINT(vm);']
+        return ['if (cond_flags(vm) & %d) {' % dr, '    ' + jump, '}', '(void)CHECKPOINT(vm);']
+    if op in (0x1, 0x5):  # ADD, AND
+        sign = '+' if op == 0x1 else '&'
+        if word & 0x20:
+            if op == 0x5 and imm5 == 0:
+                return ['vm->reg[%d] = 0;' % dr, flags]
+            value = ('vm->reg[%d] %s' % (sr1, plus(imm5)) if op == 0x1 else
+                     'vm->reg[%d] & 0x%04X' % (sr1, imm5 & 0xFFFF))
+        else:
+            value = 'vm->reg[%d] %s vm->reg[%d]' % (sr1, sign, sr2)
+        return ['vm->reg[%d] = %s;' % (dr, value), flags]
+    if op == 0x9:       # NOT
+        return ['vm->reg[%d] = ~vm->reg[%d];' % (dr, sr1), flags]
+    if op == 0x2:       # LD
+        return ['vm->reg[%d] = mem_read(vm, %s);' % (dr, pc_off9), flags]
+    if op == 0xA:       # LDI
+        return ['vm->reg[%d] = mem_read(vm, mem_read(vm, %s));' % (dr, pc_off9), flags]
+    if op == 0x6:       # LDR
+        return ['vm->reg[%d] = mem_read(vm, vm->reg[%d] %s);' % (dr, sr1, plus(off6)), flags]
+    if op == 0xE:       # LEA
+        return ['vm->reg[%d] = %s;' % (dr, pc_off9), flags]
+    # Stores: the loop stops on vm->running, so what mem_write() returns is not needed
+    if op == 0x3:       # ST
+        return ['mem_write(vm, %s, vm->reg[%d]);' % (pc_off9, dr)]
+    if op == 0xB:       # STI
+        return ['mem_write(vm, mem_read(vm, %s), vm->reg[%d]);' % (pc_off9, dr)]
+    if op == 0x7:       # STR
+        return ['mem_write(vm, vm->reg[%d] %s, vm->reg[%d]);' % (sr1, plus(off6), dr)]
+    # Calls and returns keep vm->calls for --sample and --callgraph, as jsr() and jmp() do
+    if op == 0x4:       # JSR, JSRR: R7 is written first, so JSRR R7 falls through
+        target = 'vm->reg[R_PC] %s' % plus(off11) if word & 0x800 else 'vm->reg[%d]' % sr1
+        return ['vm->reg[R_R7] = vm->reg[R_PC];', 'vm->reg[R_PC] = %s;' % target,
+                'if (vm->calls) {',
+                '    call_enter(vm->calls, vm->reg[R_PC], vm->reg[R_R7], vm->instructions);',
+                '}',
+                '(void)CHECKPOINT(vm);']
+    if op == 0xC:       # JMP
+        lines = ['vm->reg[R_PC] = vm->reg[%d];' % sr1]
+        if sr1 == 7:
+            lines += ['if (vm->calls) {',
+                      '    call_return(vm->calls, vm->reg[R_PC], vm->instructions);',
+                      '}']
+        return lines + ['(void)CHECKPOINT(vm);']
+    if op == 0xF:       # TRAP, unknown vectors do nothing
+        return [TRAPS[word & 0xFF]] if (word & 0xFF) in TRAPS else []
+    return ['illegal_instruction(vm);']     # RTI, RES
+
+
+def main():
+    out = sys.stdout
+    out.write('// Generated by gen_handlers.py, do not edit. Included by lc3-vm.c.\n\n')
+    names = {}          # body: name of the handler that has it
+    table = []
+    for word in range(1 << 16):
+        lines = body(word)
+        key = '\n'.join(lines)
+        if key not in names:
+            names[key] = 'h_%04X' % word
+            out.write('static void %s(struct vm* vm) {\n' % names[key])
+            out.write(''.join('    %s\n' % line for line in lines) or '    (void)vm;\n')
+            out.write('}\n')
+        table.append(names[key])
+
+    out.write('\n// Indexed by the instruction word\n')
+    out.write('static void (*const handler_table[1 << 16])(struct vm* vm) = {\n')
+    for i in range(0, len(table), 8):
+        out.write('    ' + ', '.join(table[i:i + 8]) + ',\n')
+    out.write('};\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -1,23 +1,37 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <poll.h>
+
+// The image loader byte swaps with SSSE3/AVX2 shuffles when the CPU has them
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_SIMD_SWAP 1
+#include <immintrin.h>
+#endif
 /****************************************************************************************************
  *                                Start of Global Variables                                         *
  ***************************************************************************************************/
-// Create a variable to determine if the program is running
-int running;
-
-// Create memory: 65536 locations
-uint16_t memory[UINT16_MAX];
+// Memory has 65536 locations, the program starts at 0x3000
+enum {
+    MEMORY_MAX = 1 << 16,
+    PC_START   = 0x3000
+};
 
 // Create the registers:
 enum registers {
@@ -33,7 +47,6 @@ enum registers {
     R_COND,
     R_COUNT
 };
-uint16_t reg[R_COUNT];
 
 // Create the instructions:
 enum operations {
@@ -75,10 +88,322 @@ enum traps {
 // Create memory mapped registers
 enum mem_regs {
     MR_KBSR = 0xFE00,       // Keyboard Status
-    MR_KBDR = 0xFE02        // Keyboard Data
+    MR_KBDR = 0xFE02,       // Keyboard Data
+    MR_DSR  = 0xFE04,       // Display Status
+    MR_DDR  = 0xFE06,       // Display Data
+    MR_MCR  = 0xFFFE        // Machine Control
+};
+
+enum { MCR_CLOCK_ENABLE = 1 << 15 };
+
+// The memory bus: the address space is cut into pages of BUS_PAGE_SIZE words, and a page either
+//  is plain memory or belongs to a device that sees every load and store to it. Device registers
+//  live in memory[] like any other word, so clones and snapshots carry them along. Compiled code
+//  hands every access from JIT_DEVICE_PAGE up to the interpreter, a device mapped lower than that
+//  needs it lowered.
+enum {
+    BUS_PAGE_SHIFT = 8,
+    BUS_PAGE_SIZE  = 1 << BUS_PAGE_SHIFT,
+    BUS_PAGES      = MEMORY_MAX >> BUS_PAGE_SHIFT
+};
+
+struct vm;
+
+struct device {
+    const char* name;
+    uint16_t (*read)(struct vm* vm, uint16_t addr);
+    void (*write)(struct vm* vm, uint16_t addr, uint16_t val);
 };
 
+// Terminal settings to restore on exit. This is the only state shared by every vm in the process
 struct termios original_tio;
+int input_buffering_disabled;
+
+// Pre-decoded shadow of memory, one record per word. Filled in lazily the first time a word is
+//  fetched by the decoded engine and reset by mem_write when the word is overwritten
+enum decoded_ids {
+    D_UNDECODED = 0,        // Must stay 0 so a zeroed record means "decode me"
+    D_BR,
+    D_ADD_REG,
+    D_ADD_IMM,
+    D_LD,
+    D_ST,
+    D_JSR,
+    D_JSRR,
+    D_AND_REG,
+    D_AND_IMM,
+    D_LDR,
+    D_STR,
+    D_RTI,
+    D_NOT,
+    D_LDI,
+    D_STI,
+    D_JMP,
+    D_RES,
+    D_LEA,
+    D_TRAP,
+    D_LD_RAM,               // Loads and stores that can never reach a device, see ram_access_id()
+    D_ST_RAM,
+    D_LDR_RAM,
+    D_STR_RAM,
+    D_COUNT
+};
+
+struct decoded {
+    uint8_t id;             // One of enum decoded_ids
+    uint8_t r0;             // DR, SR (stores) or the nzp mask (BR)
+    uint8_t r1;             // SR1 / BaseR
+    uint8_t r2;             // SR2
+    uint16_t imm;           // Sign extended immediate, trap vector, or the absolute address for
+                            //  PC relative instructions (the PC is known when the word is decoded)
+};
+
+// Basic block translation cache. A block is the run of instructions from its start address up to
+//  and including the first BR/JMP/JSR/TRAP, translated once into an array of block_ops that
+//  point straight at their handlers
+enum {
+    BLOCK_MAX_LENGTH = 64,          // Longer runs are split and fall through to the next block
+    BLOCK_MAX_COUNT  = 1 << 13,
+    BLOCK_MAX_OPS    = 1 << 16
+};
+
+struct block_op {
+    const void* handler;    // Label of the handler in run_blocks()
+    uint16_t next_pc;       // Address of the following instruction
+    uint8_t r0;             // Same fields as struct decoded
+    uint8_t r1;
+    uint8_t r2;
+    uint16_t imm;
+};
+
+struct block {
+    uint16_t start;
+    uint16_t length;
+    struct block_op* ops;
+    struct block* taken;    // Chained successor when the branch/JSR is taken
+    struct block* next;     // Chained successor for the fall through path
+};
+
+// Superinstructions of the block engine, by enum decoded_ids without the D_. A block whose ops
+//  start one of these sequences gets a single handler that runs them all and dispatches once.
+//  Only the last one may end a block. The set comes from bench/fusion.py run on the profiles of
+//  the bench/ workloads, plus the constant load (AND Rx, Rx, #0 then ADD Rx, Rx, #imm).
+#define FUSION_PAIRS(X) \
+    X(ADD_IMM, BR) \
+    X(AND_IMM, ADD_IMM) \
+    X(AND_IMM, ADD_REG) \
+    X(ADD_REG, ADD_IMM) \
+    X(LDR, ADD_REG) \
+    X(LDR_RAM, ADD_REG) \
+    X(LDR, ADD_IMM) \
+    X(LDR_RAM, ADD_IMM) \
+    X(LDR, LDR) \
+    X(LDR, LDR_RAM) \
+    X(LDR_RAM, LDR) \
+    X(LDR_RAM, LDR_RAM) \
+    X(STR, STR) \
+    X(STR, STR_RAM) \
+    X(STR_RAM, STR) \
+    X(STR_RAM, STR_RAM) \
+    X(ADD_REG, STR) \
+    X(ADD_REG, STR_RAM) \
+    X(ADD_IMM, STR) \
+    X(ADD_IMM, STR_RAM)
+
+#define FUSION_TRIPLES(X) \
+    X(LDR, ADD_REG, STR) \
+    X(LDR, ADD_REG, STR_RAM) \
+    X(LDR_RAM, ADD_REG, STR) \
+    X(LDR_RAM, ADD_REG, STR_RAM) \
+    X(STR, STR, STR) \
+    X(STR_RAM, STR_RAM, STR_RAM)
+
+struct block_cache {
+    struct block blocks[BLOCK_MAX_COUNT];
+    struct block_op ops[BLOCK_MAX_OPS];
+    int count;
+    int op_count;
+    struct block* map[MEMORY_MAX];          // Block starting at each address, or NULL
+    uint32_t generation;                    // Bumped every time the cache is flushed
+};
+
+// Bits in vm->code_map, for invalidate_code() to know what some engine has cached for a word
+enum code_bits {
+    CODE_DECODED    = 1 << 0,       // vm->decoded holds a record for the word
+    CODE_TRANSLATED = 1 << 1,       // The word is part of a translated block or compiled code
+    CODE_ANALYZED   = 1 << 2,       // analyze_code() took the word for code
+    CODE_NO_IO      = 1 << 3        // An LDR/STR that analyze_code() proved never reaches a device
+};
+
+// vm->code_pages has a byte for every 64 words, set once any word in them gets code_map bits.
+//  A store looks at the page first, and at the word's code_map bits only on a page that holds
+//  code, so stores to data pages cost no more than the array write.
+enum {
+    CODE_PAGE_SHIFT = 6,
+    CODE_PAGES      = MEMORY_MAX >> CODE_PAGE_SHIFT
+};
+
+// When buffered console output is written out. It is always written before the guest reads the
+//  keyboard, when it halts, and when run() returns.
+enum flush_policies {
+    FLUSH_AUTO = 0,                 // FLUSH_IMMEDIATE if the output is a terminal, else FLUSH_SIZE
+    FLUSH_IMMEDIATE,                // After every output trap
+    FLUSH_LINE,                     // At every newline
+    FLUSH_SIZE,                     // When CONSOLE_BUFFER_SIZE bytes are waiting
+    FLUSH_COUNT
+};
+
+enum { CONSOLE_BUFFER_SIZE = 1 << 16 };
+
+// Keyboard input drained from a file descriptor by a thread of its own, so that polling KBSR and
+//  reading a key never make a syscall. One producer (the thread) and one consumer (the vm):
+//  head and tail only ever grow and each is written by one side only. The lock and condition are
+//  only used to sleep when one side has to wait for the other.
+enum { INPUT_RING_SIZE = 1 << 16 };         // Power of two
+
+// Keyboard input from a regular file, mapped and read in place. Always ready, EOF at the end.
+struct input_map {
+    const uint8_t* data;                    // NULL for an empty file
+    size_t size;
+    size_t at;
+};
+
+// Longest a keyboard polling loop sleeps before it goes round again, see console_device_read()
+enum { IDLE_TIMEOUT_MS = 100 };
+
+struct input_ring {
+    pthread_t thread;
+    int fd;
+    _Atomic size_t head;                    // Next byte the thread writes
+    _Atomic size_t tail;                    // Next byte the vm reads
+    _Atomic int closed;                     // The thread hit EOF or an error and is gone
+    _Atomic int stopping;                   // Set by input_ring_stop()
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t data[INPUT_RING_SIZE];
+};
+
+// Limits on a run, 0 for none. Going over one stops the vm with vm->stop saying which.
+struct limits {
+    uint64_t instructions;
+    double seconds;                 // Wall time
+    uint64_t output;                // Console bytes
+};
+
+enum stop_reasons {
+    STOP_NONE = 0,                  // Still running, or halted by the guest
+    STOP_INSTRUCTIONS,
+    STOP_TIME,
+    STOP_OUTPUT,
+    STOP_COUNT
+};
+
+// The engines only compare vm->instructions with vm->check_at, once per block or control
+//  transfer, and leave everything else to budget_check(). Wall time is looked at every
+//  BUDGET_INTERVAL instructions.
+enum { BUDGET_INTERVAL = 1 << 20 };
+
+// --profile counts every instruction executed, in flat arrays indexed by PC. Clones of a profiled
+//  vm add to the same counters.
+struct profile {
+    uint64_t executed[MEMORY_MAX];
+    uint64_t taken[MEMORY_MAX];     // Only BRs, not taken is executed - taken
+    uint64_t opcodes[16];
+    FILE* report;                   // Where profile_report() writes
+};
+
+// The vm run() is running with a profile or a call stack, for the signal handlers
+extern struct vm* volatile profiled_vm;
+
+// --callgraph costs, in instructions and seconds. Inclusive cost counts a routine's callees,
+//  exclusive cost does not. A recursive routine only adds inclusive cost when its outermost
+//  call returns.
+struct routine_cost {
+    uint64_t calls;
+    int active;                     // Calls on the stack right now
+    uint64_t inclusive;
+    uint64_t exclusive;
+    double inclusive_time;
+    double exclusive_time;
+};
+
+// One per caller/callee pair that has been seen, calls is 0 for a free slot
+struct call_edge {
+    uint16_t caller;
+    uint16_t callee;
+    uint64_t calls;
+    int active;                     // Calls along the edge on the stack right now
+    uint64_t inclusive;
+    double inclusive_time;
+};
+
+enum { CALL_EDGE_SLOTS = 1 << 14 };
+
+struct symbols;
+
+struct call_graph {
+    struct routine_cost routines[MEMORY_MAX];
+    struct call_edge edges[CALL_EDGE_SLOTS];
+    uint64_t dropped;               // Calls whose pair did not fit in edges
+    struct symbols* symbols;        // Names routines in the report, may be NULL
+    FILE* report;
+};
+
+// Guest subroutine calls, followed by jsr() and jmp() while vm->calls is set: JSR and JSRR push a
+//  frame, JMP R7 (RET) pops back to the frame it returns from. Returns that match no frame are
+//  taken for plain jumps. Frames past CALL_STACK_MAX are only counted in depth.
+enum { CALL_STACK_MAX = 256 };
+
+struct call_frame {
+    uint16_t routine;               // Address called
+    uint16_t return_to;             // R7 at the call
+    // Only kept with a call graph
+    uint64_t instructions;          // vm->instructions at the call
+    double time;
+    uint64_t child_instructions;    // Inclusive cost of the calls it made
+    double child_time;
+    struct call_edge* edge;
+};
+
+struct call_stack {
+    struct call_frame root;         // The PC the run started at, the root of every stack
+    int depth;
+    struct call_frame frames[CALL_STACK_MAX];
+    struct call_graph* graph;       // Costs are added up here when set, not owned by the stack
+};
+
+struct jit;
+
+// All the state of one machine. Handlers, traps and memory functions take the vm they run on,
+//  so any number of machines can live in one process.
+struct vm {
+    uint16_t reg[R_COUNT];          // Must stay first, compiled code addresses it directly
+    uint32_t flags_result;          // See update_flags()
+    int running;
+    uint64_t instructions;          // Executed so far, kept by every engine
+    FILE* input;                    // Keyboard and console, stdin and stdout unless redirected
+    FILE* output;
+    struct input_ring* keyboard;    // Read instead of vm->input when set, not owned by the vm
+    struct input_map* keyboard_map; // Same
+    int flush_policy;               // enum flush_policies
+    char* console;                  // Output not yet written to vm->output
+    size_t console_length;
+    struct limits limits;           // Set before run()
+    uint64_t check_at;              // See BUDGET_INTERVAL, worked out by run()
+    uint64_t instruction_limit;     // vm->limits as absolute values for this run
+    double deadline;
+    uint64_t output_bytes;
+    int stop;                       // enum stop_reasons
+    struct profile* profile;        // Runs on run_profiled() when set, not owned by the vm
+    struct call_stack* calls;       // Followed when set, not owned by the vm
+    uint16_t* memory;               // MEMORY_MAX words
+    uint8_t* code_map;              // enum code_bits for every word
+    uint8_t code_pages[CODE_PAGES]; // See CODE_PAGE_SHIFT, never cleared
+    int analyzed;                   // analyze_code() has run on this vm
+    struct decoded* decoded;        // Allocated by the engines that use them
+    struct block_cache* blocks;
+    struct jit* jit;
+};
 /****************************************************************************************************
  *                                  End of Global Variables                                         *
  ***************************************************************************************************/
@@ -95,99 +420,751 @@ uint16_t sign_extend(uint16_t x, int bit_count) {
 }
 
 
-void update_flags(uint16_t r) {
-    if (reg[r] == 0) {
-        reg[R_COND] = FL_ZRO;
-    } else if (reg[r] >> 15) {
-        // If the leftmost bit is a 1, then the number is negative
-        //  shift right 15 times to get the most significant bit only
-        reg[R_COND] = FL_NEG;
-    } else {
-        reg[R_COND] = FL_POS;
+// The condition codes are evaluated lazily: update_flags only records the value it was given,
+//  and cond_flags() turns it into FL_* when something reads them. FLAGS_SYNCED means
+//  reg[R_COND] is up to date and flags_result holds nothing.
+enum { FLAGS_SYNCED = 1 << 16 };
+
+static inline void update_flags(struct vm* vm, uint16_t r) {
+    vm->flags_result = vm->reg[r];
+}
+
+static inline uint16_t cond_flags(struct vm* vm) {
+    if (vm->flags_result & FLAGS_SYNCED) {
+        return vm->reg[R_COND];
     }
+    if (vm->flags_result == 0) {
+        return FL_ZRO;
+    }
+    // If the leftmost bit is a 1, then the number is negative
+    //  shift right 15 times to get the most significant bit only
+    return (vm->flags_result >> 15) ? FL_NEG : FL_POS;
+}
+
+// Writes the pending flags to reg[R_COND], for code that reads the register directly
+void sync_flags(struct vm* vm) {
+    vm->reg[R_COND] = cond_flags(vm);
+    vm->flags_result = FLAGS_SYNCED;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
+
 uint16_t change_endian(uint16_t v) {
     return (v << 8) | (v >> 8);
 }
 
 
-void read_image_file(FILE* file) {
+// Copies count big endian words from src into host order at dst. src may be unaligned, and may
+//  be dst itself to swap in place. Uses the widest byte shuffle the CPU running us has.
+void swap_words_scalar(uint16_t* dst, const uint8_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = (src[2 * i] << 8) | src[2 * i + 1];
+    }
+}
+
+#ifdef HAVE_SIMD_SWAP
+__attribute__((target("ssse3")))
+void swap_words_ssse3(uint16_t* dst, const uint8_t* src, size_t count) {
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(v, mask));
+    }
+    swap_words_scalar(dst + i, src + 2 * i, count - i);
+}
+
+__attribute__((target("avx2")))
+void swap_words_avx2(uint16_t* dst, const uint8_t* src, size_t count) {
+    // vpshufb shuffles within each 128 bit lane, so both lanes get the same mask
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + 2 * i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+    swap_words_ssse3(dst + i, src + 2 * i, count - i);
+}
+#endif
+
+void swap_words(uint16_t* dst, const uint8_t* src, size_t count) {
+#ifdef HAVE_SIMD_SWAP
+    if (__builtin_cpu_supports("avx2")) {
+        swap_words_avx2(dst, src, count);
+        return;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        swap_words_ssse3(dst, src, count);
+        return;
+    }
+#endif
+    swap_words_scalar(dst, src, count);
+}
+
+
+// Image files are a big endian origin followed by the big endian words to put there. Words past
+//  the end of memory are dropped. Returns 0 if there is not even an origin.
+int read_image_file(struct vm* vm, FILE* file) {
     // Origin says where to put the .text section
     uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
+    if (fread(&origin, sizeof(origin), 1, file) != 1) {
+        return 0;
+    }
     origin = change_endian(origin);
 
-    // We know the max possible file size (last possible address - starting addr)
+    // We know the max possible file size (end of memory - starting addr)
     //  so only 1 fread is needed
-    uint16_t max_read = UINT16_MAX - origin;
-    uint16_t* p = memory + origin;
+    size_t max_read = MEMORY_MAX - origin;
+    uint16_t* p = vm->memory + origin;
     size_t read = fread(p, sizeof(uint16_t), max_read, file);
 
     // Swap to little endian
-    while (read-- > 0) {
-        *p = change_endian(*p);
-        ++p;
+    swap_words(p, (const uint8_t*)p, read);
+    return 1;
+}
+
+
+// Reads the file straight into guest memory and swaps it there, no stdio buffer in between.
+//  Images are at most 128KB, and for that little mapping the file costs more in page faults and
+//  munmap than a read does.
+int read_image(struct vm* vm, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        // A pipe or a device, go through stdio
+        FILE* file = fdopen(fd, "rb");
+        if (!file) {
+            close(fd);
+            return 0;
+        }
+        int loaded = read_image_file(vm, file);
+        fclose(file);
+        return loaded;
+    }
+
+    uint8_t origin_bytes[2];
+    if (pread(fd, origin_bytes, sizeof(origin_bytes), 0) != sizeof(origin_bytes)) {
+        close(fd);
+        return 0;
     }
+    uint16_t origin = (origin_bytes[0] << 8) | origin_bytes[1];
+    uint16_t* p = vm->memory + origin;
+    size_t want = (MEMORY_MAX - origin) * sizeof(uint16_t);
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = pread(fd, (uint8_t*)p + got, want - got, sizeof(origin_bytes) + got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+
+    swap_words(p, (const uint8_t*)p, got / 2);
+    return 1;
 }
 
 
-int read_image(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (!file) {
+// Guest output goes through the vm's console buffer, written to vm->output as the flush policy says
+void console_flush(struct vm* vm) {
+    if (vm->console_length) {
+        fwrite(vm->console, 1, vm->console_length, vm->output);
+        fflush(vm->output);
+        vm->console_length = 0;
+    }
+}
+
+static inline void console_putc(struct vm* vm, char c) {
+    if (vm->limits.output && vm->output_bytes == vm->limits.output) {
+        // The trap finishes, the engine stops right after it
+        vm->stop = STOP_OUTPUT;
+        vm->running = 0;
+        return;
+    }
+    ++vm->output_bytes;
+    if (vm->console_length == CONSOLE_BUFFER_SIZE) {
+        console_flush(vm);
+    }
+    vm->console[vm->console_length++] = c;
+    if (c == '\n' && vm->flush_policy == FLUSH_LINE) {
+        console_flush(vm);
+    }
+}
+
+void console_puts(struct vm* vm, const char* s) {
+    while (*s) {
+        console_putc(vm, *s++);
+    }
+}
+
+// Called at the end of every output trap
+static inline void console_trap_done(struct vm* vm) {
+    if (vm->flush_policy == FLUSH_IMMEDIATE) {
+        console_flush(vm);
+    }
+}
+
+const char* flush_names[FLUSH_COUNT] = {
+    [FLUSH_AUTO]      = "auto",
+    [FLUSH_IMMEDIATE] = "immediate",
+    [FLUSH_LINE]      = "line",
+    [FLUSH_SIZE]      = "size",
+};
+
+int parse_flush_policy(const char* name) {
+    for (int i = 0; i < FLUSH_COUNT; ++i) {
+        if (strcmp(name, flush_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Indexed by enum stop_reasons
+const char* stop_names[STOP_COUNT] = {
+    "halted", "instruction limit", "time limit", "output limit"
+};
+
+void budget_next_check(struct vm* vm) {
+    vm->check_at = vm->instruction_limit ? vm->instruction_limit : UINT64_MAX;
+    if (vm->deadline && vm->instructions + BUDGET_INTERVAL < vm->check_at) {
+        vm->check_at = vm->instructions + BUDGET_INTERVAL;
+    }
+}
+
+// Called by run() before the engine starts
+void budget_start(struct vm* vm) {
+    vm->instruction_limit = vm->limits.instructions ? vm->instructions + vm->limits.instructions : 0;
+    vm->deadline = vm->limits.seconds > 0 ? now_seconds() + vm->limits.seconds : 0;
+    vm->output_bytes = 0;
+    vm->stop = STOP_NONE;
+    budget_next_check(vm);
+}
+
+// Called by the engines once vm->instructions reaches vm->check_at. Returns vm->running, cleared
+//  if a limit has been hit, with vm->reg[R_PC] where the vm stops. Kept out of line so the
+//  checkpoints in the dispatch loops stay a compare and a branch.
+__attribute__((noinline))
+int budget_check(struct vm* vm) {
+    if (vm->instruction_limit && vm->instructions >= vm->instruction_limit) {
+        vm->stop = STOP_INSTRUCTIONS;
+        vm->running = 0;
         return 0;
     }
-    read_image_file(file);
-    fclose(file);
+    if (vm->deadline && now_seconds() >= vm->deadline) {
+        vm->stop = STOP_TIME;
+        vm->running = 0;
+        return 0;
+    }
+    budget_next_check(vm);
     return 1;
 }
 
+// RTI and RES stop the whole process, but not before the guest's output is out
+void illegal_instruction(struct vm* vm) {
+    console_flush(vm);
+    abort();
+}
+
+
+void* input_ring_thread(void* arg) {
+    struct input_ring* ring = arg;
+    // input_ring_stop() may only cancel the thread while it is blocked in read(), never while it
+    //  holds the lock
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    // The sampler's SIGPROF is meant for the thread running the vm
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    for (;;) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - tail == INPUT_RING_SIZE) {
+            // Full, wait for the vm to make room
+            pthread_mutex_lock(&ring->lock);
+            while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == INPUT_RING_SIZE &&
+                   !atomic_load(&ring->stopping)) {
+                pthread_cond_wait(&ring->changed, &ring->lock);
+            }
+            pthread_mutex_unlock(&ring->lock);
+            if (atomic_load(&ring->stopping)) {
+                return NULL;
+            }
+            continue;
+        }
+
+        // As much as fits before the end of the buffer, in one read
+        size_t at = head & (INPUT_RING_SIZE - 1);
+        size_t room = INPUT_RING_SIZE - (head - tail);
+        if (room > INPUT_RING_SIZE - at) {
+            room = INPUT_RING_SIZE - at;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ssize_t n = read(ring->fd, ring->data + at, room);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        if (n > 0) {
+            atomic_store_explicit(&ring->head, head + n, memory_order_release);
+        } else {
+            atomic_store_explicit(&ring->closed, 1, memory_order_release);
+        }
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        if (n <= 0) {
+            return NULL;
+        }
+    }
+}
+
+// Starts draining fd, returns NULL if the thread could not be started
+struct input_ring* input_ring_start(int fd) {
+    struct input_ring* ring = malloc(sizeof(struct input_ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->fd = fd;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->stopping, 0);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    if (pthread_create(&ring->thread, NULL, input_ring_thread, ring) != 0) {
+        pthread_cond_destroy(&ring->changed);
+        pthread_mutex_destroy(&ring->lock);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void input_ring_stop(struct input_ring* ring) {
+    pthread_mutex_lock(&ring->lock);
+    atomic_store(&ring->stopping, 1);
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_cancel(ring->thread);
+    pthread_join(ring->thread, NULL);
+    pthread_cond_destroy(&ring->changed);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+// Whether input_ring_getc() would return straight away, which it also does at EOF
+static inline int input_ring_ready(struct input_ring* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) !=
+           atomic_load_explicit(&ring->tail, memory_order_relaxed) ||
+           atomic_load_explicit(&ring->closed, memory_order_acquire);
+}
+
+// Blocks until there is a byte, returns (uint16_t)EOF once the input is exhausted like getc would
+uint16_t input_ring_getc(struct input_ring* ring) {
+    if (!input_ring_ready(ring)) {
+        pthread_mutex_lock(&ring->lock);
+        while (!input_ring_ready(ring)) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        pthread_mutex_unlock(&ring->lock);
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+        return (uint16_t)EOF;
+    }
+    uint8_t c = ring->data[tail & (INPUT_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    if (atomic_load_explicit(&ring->head, memory_order_relaxed) - tail == INPUT_RING_SIZE) {
+        // The ring was full, the thread may be waiting for this slot
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return c;
+}
+
+
+// Maps fd if it is a regular file, returns NULL for anything else
+struct input_map* input_map_open(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    struct input_map* map = calloc(1, sizeof(struct input_map));
+    if (!map) {
+        return NULL;
+    }
+    if (st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            free(map);
+            return NULL;
+        }
+        map->data = data;
+        map->size = st.st_size;
+    }
+    return map;
+}
+
+void input_map_close(struct input_map* map) {
+    if (map->data) {
+        munmap((void*)map->data, map->size);
+    }
+    free(map);
+}
 
-uint16_t check_key() {
+
+uint16_t check_key(struct vm* vm) {
+    if (vm->keyboard_map) {
+        return 1;
+    }
+    if (vm->keyboard) {
+        return input_ring_ready(vm->keyboard);
+    }
+    int fd = fileno(vm->input);
     fd_set readfds;
     FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+    FD_SET(fd, &readfds);
     struct timeval timeout;
     timeout.tv_sec = 0;
     timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+    return select(fd + 1, &readfds, NULL, NULL, &timeout) != 0;
+}
+
+// Waits up to timeout_ms for a key, returns early if one is already there
+void wait_for_key(struct vm* vm, int timeout_ms) {
+    if (vm->keyboard) {
+        struct input_ring* ring = vm->keyboard;
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (long)timeout_ms * 1000000;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        pthread_mutex_lock(&ring->lock);
+        while (!input_ring_ready(ring)) {
+            if (pthread_cond_timedwait(&ring->changed, &ring->lock, &until) != 0) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&ring->lock);
+    } else {
+        struct pollfd fd = { .fd = fileno(vm->input), .events = POLLIN };
+        poll(&fd, 1, timeout_ms);
+    }
+}
+
+// Blocks for the next key, (uint16_t)EOF when there are no more
+uint16_t read_key(struct vm* vm) {
+    if (vm->keyboard_map) {
+        struct input_map* map = vm->keyboard_map;
+        return map->at < map->size ? map->data[map->at++] : (uint16_t)EOF;
+    }
+    if (vm->keyboard) {
+        return input_ring_getc(vm->keyboard);
+    }
+    return (uint16_t)getc(vm->input);
+}
+
+
+// Whether the load that just read KBSR (the instruction before the PC) is the first half of a
+//  loop that does nothing but wait for a key:
+//      POLL  LDI Rx, KBSR_PTR      (or LD Rx, KBSR, or LDR Rx, Ry, #n with Ry + n = KBSR, Ry != Rx)
+//            BRz/BRzp/BRnz/BRnzp POLL
+//  While no key is ready every turn of such a loop reads the same 0 and changes nothing else.
+int is_poll_loop(struct vm* vm) {
+    uint16_t pc = vm->reg[R_PC];
+    uint16_t load = vm->memory[(uint16_t)(pc - 1)];
+    uint16_t branch = vm->memory[pc];
+    uint16_t dr = (load >> 9) & 0x7;
+    uint16_t base = (load >> 6) & 0x7;
+    uint16_t address;
+
+    switch (load >> 12) {
+        case OP_LD:
+            address = pc + sign_extend(load & 0x1FF, 9);
+            break;
+        case OP_LDI:
+            address = vm->memory[(uint16_t)(pc + sign_extend(load & 0x1FF, 9))];
+            break;
+        case OP_LDR:
+            if (base == dr) {
+                return 0;
+            }
+            address = vm->reg[base] + sign_extend(load & 0x3F, 6);
+            break;
+        default:
+            return 0;
+    }
+    return address == MR_KBSR &&
+           branch >> 12 == OP_BR &&
+           ((branch >> 9) & FL_ZRO) &&
+           (uint16_t)(pc + 1 + sign_extend(branch & 0x1FF, 9)) == (uint16_t)(pc - 1);
 }
 
 
-uint16_t mem_read(uint16_t addr) {
+// The I/O page: the keyboard and display registers. Reads of KBSR poll the keyboard and latch the
+//  next key into KBDR. DSR always reads as ready, the display is the vm's console buffer
+uint16_t console_device_read(struct vm* vm, uint16_t addr) {
     if (addr == MR_KBSR) {
-        if (check_key()) {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+        // A prompt has to be out before the guest looks for the answer
+        console_flush(vm);
+        if (!check_key(vm) && is_poll_loop(vm)) {
+            // The guest would only spin until a key arrives, sleep instead. The timeout bounds
+            //  how long the vm goes without coming back to the engine loop
+            wait_for_key(vm, IDLE_TIMEOUT_MS);
+            // Sleeping does not count instructions, make sure the deadline still gets looked at
+            if (vm->deadline) {
+                vm->check_at = 0;
+            }
+        }
+        if (check_key(vm)) {
+            vm->memory[MR_KBSR] = (1 << 15);
+            vm->memory[MR_KBDR] = read_key(vm);
         } else {
-            memory[MR_KBSR] = 0;
+            vm->memory[MR_KBSR] = 0;
         }
+    } else if (addr == MR_DSR) {
+        vm->memory[MR_DSR] = (1 << 15);
     }
-    return memory[addr];
+    return vm->memory[addr];
 }
 
-void mem_write(uint16_t addr, uint16_t val) {
-    memory[addr] = val;
+void console_device_write(struct vm* vm, uint16_t addr, uint16_t val) {
+    vm->memory[addr] = val;
+    if (addr == MR_DDR) {
+        // Same as an OUT trap
+        console_putc(vm, (char)val);
+        console_trap_done(vm);
+    }
+}
+
+uint16_t machine_control_read(struct vm* vm, uint16_t addr) {
+    return vm->memory[addr];
+}
+
+// Clearing the clock enable bit of MCR stops the machine, as the HALT routine of the LC-3 OS does.
+//  run() sets it again when the vm starts.
+void machine_control_write(struct vm* vm, uint16_t addr, uint16_t val) {
+    vm->memory[addr] = val;
+    if (addr == MR_MCR && !(val & MCR_CLOCK_ENABLE)) {
+        console_flush(vm);
+        vm->running = 0;
+    }
+}
+
+const struct device console_device = {
+    "console", console_device_read, console_device_write
+};
+
+const struct device machine_control = {
+    "machine control", machine_control_read, machine_control_write
+};
+
+// The device on every bus page, NULL for plain memory
+const struct device* const bus[BUS_PAGES] = {
+    [MR_KBSR >> BUS_PAGE_SHIFT] = &console_device,
+    [MR_MCR >> BUS_PAGE_SHIFT]  = &machine_control,
+};
+
+// Loads and stores look up the page and only leave the plain array access when a device is there.
+//  Instruction fetch reads memory[] directly and never goes near the bus.
+static inline uint16_t mem_read(struct vm* vm, uint16_t addr) {
+    const struct device* device = bus[addr >> BUS_PAGE_SHIFT];
+    if (__builtin_expect(device != NULL, 0)) {
+        return device->read(vm, addr);
+    }
+    return vm->memory[addr];
+}
+
+static inline uint16_t mem_fetch(struct vm* vm, uint16_t addr) {
+    return vm->memory[addr];
+}
+
+void invalidate_code(struct vm* vm, uint16_t addr);
+
+// A store known to miss every device
+static inline void ram_write(struct vm* vm, uint16_t addr, uint16_t val) {
+    vm->memory[addr] = val;
+    if (__builtin_expect(vm->code_pages[addr >> CODE_PAGE_SHIFT], 0) && vm->code_map[addr]) {
+        invalidate_code(vm, addr);
+    }
+}
+
+// Every code_map bit is set through here, so that the page is marked too
+static inline void mark_code(struct vm* vm, uint16_t addr, uint8_t bits) {
+    vm->code_map[addr] |= bits;
+    vm->code_pages[addr >> CODE_PAGE_SHIFT] = 1;
 }
 
+// Returns whether the vm is still running, which only a device can change. The engines stop right
+//  after a store that returns 0.
+static inline int mem_write(struct vm* vm, uint16_t addr, uint16_t val) {
+    const struct device* device = bus[addr >> BUS_PAGE_SHIFT];
+    if (__builtin_expect(device != NULL, 0)) {
+        device->write(vm, addr, val);
+        return vm->running;
+    }
+    ram_write(vm, addr, val);
+    return 1;
+}
 
 void disable_input_buffering() {
     tcgetattr(STDIN_FILENO, &original_tio);
     struct termios new_tio = original_tio;
     new_tio.c_lflag &= ~ICANON & ~ECHO;
     tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    input_buffering_disabled = 1;
 }
 
 void restore_input_buffering() {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    if (input_buffering_disabled) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    }
 }
 
 
+void profile_report(struct vm* vm);
+void sampler_report();
+void call_graph_finish(struct call_stack* calls, uint64_t instructions);
+void call_graph_report(struct call_graph* graph);
+
 void sigint_handler(int signal) {
     restore_input_buffering();
     printf("\n");
+    // No more samples from here on
+    struct vm* vm = profiled_vm;
+    profiled_vm = NULL;
+    if (vm && vm->profile) {
+        profile_report(vm);
+    }
+    sampler_report();
+    if (vm && vm->calls && vm->calls->graph) {
+        call_graph_finish(vm->calls, vm->instructions);
+        call_graph_report(vm->calls->graph);
+    }
     exit(-2);
 }
+
+
+struct call_edge* find_call_edge(struct call_graph* graph, uint16_t caller, uint16_t callee) {
+    uint32_t hash = ((uint32_t)caller * 40503u) ^ callee;
+    for (int probe = 0; probe < CALL_EDGE_SLOTS; ++probe) {
+        struct call_edge* edge = &graph->edges[(hash + probe) & (CALL_EDGE_SLOTS - 1)];
+        if (!edge->calls) {
+            edge->caller = caller;
+            edge->callee = callee;
+            return edge;
+        }
+        if (edge->caller == caller && edge->callee == callee) {
+            return edge;
+        }
+    }
+    return NULL;
+}
+
+void call_graph_enter(struct call_stack* calls, struct call_frame* frame, struct call_frame* parent,
+                      uint64_t instructions) {
+    struct call_graph* graph = calls->graph;
+    frame->instructions = instructions;
+    frame->time = now_seconds();
+    frame->child_instructions = 0;
+    frame->child_time = 0;
+    frame->edge = parent ? find_call_edge(graph, parent->routine, frame->routine) : NULL;
+    if (frame->edge) {
+        ++frame->edge->calls;
+        ++frame->edge->active;
+    } else if (parent) {
+        ++graph->dropped;
+    }
+    ++graph->routines[frame->routine].calls;
+    ++graph->routines[frame->routine].active;
+}
+
+void call_graph_leave(struct call_stack* calls, struct call_frame* frame, struct call_frame* parent,
+                      uint64_t instructions, double now) {
+    struct routine_cost* cost = &calls->graph->routines[frame->routine];
+    uint64_t inclusive = instructions - frame->instructions;
+    double time = now - frame->time;
+    cost->exclusive += inclusive - frame->child_instructions;
+    cost->exclusive_time += time - frame->child_time;
+    if (--cost->active == 0) {
+        cost->inclusive += inclusive;
+        cost->inclusive_time += time;
+    }
+    // Same as routines: a recursive edge only adds its outermost call
+    if (frame->edge && --frame->edge->active == 0) {
+        frame->edge->inclusive += inclusive;
+        frame->edge->inclusive_time += time;
+    }
+    if (parent) {
+        parent->child_instructions += inclusive;
+        parent->child_time += time;
+    }
+}
+
+// Called by run() before the engine starts
+void call_graph_start(struct call_stack* calls, uint64_t instructions) {
+    call_graph_enter(calls, &calls->root, NULL, instructions);
+}
+
+// Called by run() once the engine returns: whatever is still on the stack returns now
+void call_graph_finish(struct call_stack* calls, uint64_t instructions) {
+    double now = now_seconds();
+    int depth = calls->depth < CALL_STACK_MAX ? calls->depth : CALL_STACK_MAX;
+    for (int i = depth - 1; i >= 0; --i) {
+        call_graph_leave(calls, &calls->frames[i], i ? &calls->frames[i - 1] : &calls->root,
+                         instructions, now);
+    }
+    calls->depth = 0;
+    call_graph_leave(calls, &calls->root, NULL, instructions, now);
+}
+
+// The sampler's signal handler reads the stack in the middle of these, so a frame is written
+//  before depth counts it
+void call_enter(struct call_stack* calls, uint16_t routine, uint16_t return_to, uint64_t instructions) {
+    if (calls->depth < CALL_STACK_MAX) {
+        struct call_frame* frame = &calls->frames[calls->depth];
+        frame->routine = routine;
+        frame->return_to = return_to;
+        if (calls->graph) {
+            call_graph_enter(calls, frame, calls->depth ? frame - 1 : &calls->root, instructions);
+        }
+    }
+    atomic_signal_fence(memory_order_release);
+    ++calls->depth;
+}
+
+void call_return(struct call_stack* calls, uint16_t pc, uint64_t instructions) {
+    if (calls->depth > CALL_STACK_MAX) {
+        --calls->depth;
+        return;
+    }
+    for (int i = calls->depth - 1; i >= 0; --i) {
+        if (calls->frames[i].return_to == pc) {
+            if (calls->graph) {
+                double now = now_seconds();
+                for (int j = calls->depth - 1; j >= i; --j) {
+                    call_graph_leave(calls, &calls->frames[j], j ? &calls->frames[j - 1] : &calls->root,
+                                     instructions, now);
+                }
+            }
+            calls->depth = i;
+            return;
+        }
+    }
+}
 /****************************************************************************************************
  *                                  End of Helper Functions                                         *
  ***************************************************************************************************/
@@ -196,112 +1173,119 @@ void sigint_handler(int signal) {
 /****************************************************************************************************
  *                             Start of Operation Functions                                         *
  ***************************************************************************************************/
-void and(uint16_t instruction) {
+static inline void and(struct vm* vm, uint16_t instruction) {
     uint16_t dr = (instruction >> 9) & 0x7;
     uint16_t sr1 = (instruction >> 6) & 0x7;
     uint16_t immediate_flag = (instruction >> 5) & 0x1;
 
     if (immediate_flag) {
         uint16_t immediate = sign_extend(instruction & 0x1F, 5);
-        reg[dr] = reg[sr1] & immediate;
+        vm->reg[dr] = vm->reg[sr1] & immediate;
     } else {
         uint16_t sr2 = instruction & 0x7;
-        reg[dr] = reg[sr1] & reg[sr2];
+        vm->reg[dr] = vm->reg[sr1] & vm->reg[sr2];
     }
-    update_flags(dr);
+    update_flags(vm, dr);
 }
-void not(uint16_t instruction) {
+static inline void not(struct vm* vm, uint16_t instruction) {
     uint16_t dr = (instruction >> 9) & 0x7;
     uint16_t sr = (instruction >> 6) & 0x7;
-    reg[dr] = ~reg[sr];
-    update_flags(dr);
+    vm->reg[dr] = ~vm->reg[sr];
+    update_flags(vm, dr);
 }
-void add(uint16_t instruction) {
+static inline void add(struct vm* vm, uint16_t instruction) {
     uint16_t dr = (instruction >> 9) & 0x7;
     uint16_t r1 = (instruction >> 6) & 0x7;
     uint16_t immediate_flag = (instruction >> 5) & 0x1;
 
     if (immediate_flag) {
         uint16_t immediate = sign_extend(instruction & 0x1F, 5);
-        reg[dr] = reg[r1] + immediate;
+        vm->reg[dr] = vm->reg[r1] + immediate;
     } else {
         uint16_t r2 = instruction & 0x7;
-        reg[dr] = reg[r1] + reg[r2];
+        vm->reg[dr] = vm->reg[r1] + vm->reg[r2];
     }
 
-    update_flags(dr);
+    update_flags(vm, dr);
 }
-void br(uint16_t instruction) {
+static inline void br(struct vm* vm, uint16_t instruction) {
     uint16_t offset = sign_extend(instruction & 0x1FF, 9);
     uint16_t cond_flag = (instruction >> 9) & 0x7;
-    if (cond_flag & reg[R_COND]) {
-        reg[R_PC] = reg[R_PC] + offset;
+    if (cond_flag & cond_flags(vm)) {
+        vm->reg[R_PC] = vm->reg[R_PC] + offset;
     }
 }
-void jmp(uint16_t instruction) {
+static inline void jmp(struct vm* vm, uint16_t instruction) {
     uint16_t sr = (instruction >> 6) & 0x7;
-    reg[R_PC] = reg[sr];
+    vm->reg[R_PC] = vm->reg[sr];
+    if (vm->calls && sr == R_R7) {
+        call_return(vm->calls, vm->reg[R_PC], vm->instructions);
+    }
 }
-void jsr(uint16_t instruction) {
+static inline void jsr(struct vm* vm, uint16_t instruction) {
     uint16_t offset_flag = (instruction >> 11) & 0x1;
-    reg[R_R7] = reg[R_PC];
+    vm->reg[R_R7] = vm->reg[R_PC];
 
     if (offset_flag) {
         uint16_t offset = sign_extend(instruction & 0x7FF, 11);
-        reg[R_PC] = reg[R_PC] + offset;
+        vm->reg[R_PC] = vm->reg[R_PC] + offset;
 
     } else {
         uint16_t sr = (instruction >> 6) & 0x7;
-        reg[R_PC] = reg[sr];
+        vm->reg[R_PC] = vm->reg[sr];
+    }
+    if (vm->calls) {
+        call_enter(vm->calls, vm->reg[R_PC], vm->reg[R_R7], vm->instructions);
     }
 }
-void ld(uint16_t instruction) {
+static inline void ld(struct vm* vm, uint16_t instruction) {
     uint16_t dr = (instruction >> 9) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x1FF, 9);
-    reg[dr] = mem_read(reg[R_PC] + offset);
-    update_flags(dr);
+    vm->reg[dr] = mem_read(vm, vm->reg[R_PC] + offset);
+    update_flags(vm, dr);
 }
-void st(uint16_t instruction) {
+// Stores return mem_write()'s answer, whether the vm is still running
+static inline int st(struct vm* vm, uint16_t instruction) {
     uint16_t sr = (instruction >> 9) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x1FF, 9);
-    mem_write(reg[R_PC] + offset, reg[sr]);
+    return mem_write(vm, vm->reg[R_PC] + offset, vm->reg[sr]);
 }
-void lea(uint16_t instruction) {
+static inline void lea(struct vm* vm, uint16_t instruction) {
     uint16_t dr = (instruction >> 9) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x1FF, 9);
-    reg[dr] = reg[R_PC] + offset;
-    update_flags(dr);
+    vm->reg[dr] = vm->reg[R_PC] + offset;
+    update_flags(vm, dr);
 }
-void ldi(uint16_t instruction) {
+static inline void ldi(struct vm* vm, uint16_t instruction) {
     uint16_t dr = (instruction >> 9) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x1FF, 9);
-    reg[dr] = mem_read(mem_read(reg[R_PC] + offset));
-    update_flags(dr);
+    vm->reg[dr] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + offset));
+    update_flags(vm, dr);
 }
-void sti(uint16_t instruction) {
+static inline int sti(struct vm* vm, uint16_t instruction) {
     uint16_t sr = (instruction >> 9) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x1FF, 9);
-    mem_write(mem_read(reg[R_PC] + offset), reg[sr]);
+    return mem_write(vm, mem_read(vm, vm->reg[R_PC] + offset), vm->reg[sr]);
 }
-void ldr(uint16_t instruction) {
+static inline void ldr(struct vm* vm, uint16_t instruction) {
     uint16_t dr = (instruction >> 9) & 0x7;
     uint16_t r1 = (instruction >> 6) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x3F, 6);
-    reg[dr] = mem_read(reg[r1] + offset);
-    update_flags(dr);
+    vm->reg[dr] = mem_read(vm, vm->reg[r1] + offset);
+    update_flags(vm, dr);
     return;
 }
-void str(uint16_t instruction) {
+static inline int str(struct vm* vm, uint16_t instruction) {
     uint16_t sr = (instruction >> 9) & 0x7;
     uint16_t r1 = (instruction >> 6) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x3F, 6);
-    mem_write(reg[r1] + offset, reg[sr]);
+    return mem_write(vm, vm->reg[r1] + offset, vm->reg[sr]);
 }
-void rti(uint16_t instruction) {
-    abort();
+static inline void rti(struct vm* vm, uint16_t instruction) {
+    illegal_instruction(vm);
 }
-void res(uint16_t instruction) {
-    abort();
+static inline void res(struct vm* vm, uint16_t instruction) {
+    illegal_instruction(vm);
 }
 
 
@@ -310,63 +1294,66 @@ void res(uint16_t instruction) {
  *                                  Start of Trap Functions                                         *
  ***************************************************************************************************/
 
-void trap_getc() {
-    reg[R_R0] = (uint16_t)getchar();
+void trap_getc(struct vm* vm) {
+    console_flush(vm);
+    vm->reg[R_R0] = read_key(vm);
 }
-void trap_out() {
-    putc((char)reg[R_R0], stdout);
-    fflush(stdout);
+void trap_out(struct vm* vm) {
+    console_putc(vm, (char)vm->reg[R_R0]);
+    console_trap_done(vm);
 }
-void trap_puts() {
-    uint16_t* c = memory + reg[R_R0];
+void trap_puts(struct vm* vm) {
+    uint16_t* c = vm->memory + vm->reg[R_R0];
     while (*c) {
-        putc((char)*c, stdout);
+        console_putc(vm, (char)*c);
         ++c;
     }
-    fflush(stdout);
+    console_trap_done(vm);
 }
-void trap_in() {
-    printf("Enter a character: ");
-    reg[R_R0] = (uint16_t)getchar();
+void trap_in(struct vm* vm) {
+    console_puts(vm, "Enter a character: ");
+    console_flush(vm);
+    vm->reg[R_R0] = read_key(vm);
 }
-void trap_putsp() {
-    uint16_t* c = memory + reg[R_R0];
+void trap_putsp(struct vm* vm) {
+    uint16_t* c = vm->memory + vm->reg[R_R0];
     while (*c) {
         char char1 = (*c) & 0xFF;
-        putc(char1, stdout);
+        console_putc(vm, char1);
         char char2 = (*c) >> 8;
         if (char2) {
-            putc(char2, stdout);
+            console_putc(vm, char2);
         }
         ++c;
     }
-    fflush(stdout);
+    console_trap_done(vm);
 }
-void trap_halt() {
-    printf("Halting execution\n");
-    running = 0;
+void trap_halt(struct vm* vm) {
+    console_puts(vm, "Halting execution\n");
+    console_flush(vm);
+    vm->running = 0;
 }
 
-void trap(uint16_t instruction) {
+void trap(struct vm* vm, uint16_t instruction) {
     uint16_t trapvect = instruction & 0xFF;
     switch (trapvect) {
         case TRAP_PUTS:
-            trap_puts();
+            trap_puts(vm);
             break;
         case TRAP_GETC:
-            trap_getc();
+            trap_getc(vm);
             break;
         case TRAP_OUT:
-            trap_out();
+            trap_out(vm);
             break;
         case TRAP_IN:
-            trap_in();
+            trap_in(vm);
             break;
         case TRAP_PUTSP:
-            trap_putsp();
+            trap_putsp(vm);
             break;
         case TRAP_HALT:
-            trap_halt();
+            trap_halt(vm);
             break;
     }
 }
@@ -380,90 +1367,3477 @@ void trap(uint16_t instruction) {
  *                               End of Operation Functions                                         *
  ***************************************************************************************************/
 
-int main(int argc, const char* argv[]) {
-    // Load Args
-    if (argc < 2) {
-        // Show usage string
-        printf("lc3-vm [image-file1] ...\n");
-        exit(2);
+/****************************************************************************************************
+ *                                Start of Execution Engines                                        *
+ ***************************************************************************************************/
+// The engines all execute the same handlers above; they only differ in how the next handler is
+//  chosen. Pick one at runtime with --engine=<name>.
+enum engines {
+    ENGINE_SWITCH = 0,      // One shared switch in a loop
+    ENGINE_THREADED,        // Direct threaded, one indirect jump per handler (GCC labels-as-values)
+    ENGINE_DECODED,         // Threaded over the pre-decoded instruction cache
+    ENGINE_BLOCK,           // Translated and chained basic blocks
+    ENGINE_JIT,             // Hot blocks compiled to x86-64
+    ENGINE_TABLE,           // One generated handler per instruction word, see gen_handlers.py
+    ENGINE_COUNT
+};
+
+const char* engine_names[ENGINE_COUNT] = {
+    [ENGINE_SWITCH]   = "switch",
+    [ENGINE_THREADED] = "threaded",
+    [ENGINE_DECODED]  = "decoded",
+    [ENGINE_BLOCK]    = "block",
+    [ENGINE_JIT]      = "jit",
+    [ENGINE_TABLE]    = "table",
+};
+
+// Build with -DNO_COMPUTED_GOTO to leave the threaded engine out (e.g. for non-GNU compilers)
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define HAVE_COMPUTED_GOTO 1
+#endif
+
+// Build with -DNO_JIT to leave the JIT out
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_JIT)
+#define HAVE_JIT 1
+#endif
+
+// The table engine is only built with -DHANDLER_TABLE (make HANDLER_TABLE=1). Its lc3-handlers.h
+//  is written by gen_handlers.py and takes minutes to compile.
+#ifdef HANDLER_TABLE
+#define HAVE_HANDLER_TABLE 1
+#endif
+
+#ifndef DEFAULT_ENGINE
+#ifdef HAVE_COMPUTED_GOTO
+#define DEFAULT_ENGINE ENGINE_THREADED
+#else
+#define DEFAULT_ENGINE ENGINE_SWITCH
+#endif
+#endif
+
+
+// Control transfers are where the engines look at the budget
+#define CHECKPOINT(vm) ((vm)->instructions < (vm)->check_at || budget_check(vm))
+
+static inline void execute(struct vm* vm, uint16_t instruction) {
+    uint16_t op = instruction >> 12;
+
+    switch (op) {
+        case OP_BR:
+            br(vm, instruction);
+            (void)CHECKPOINT(vm);
+            break;
+        case OP_ADD:
+            add(vm, instruction);
+            break;
+        case OP_LD:
+            ld(vm, instruction);
+            break;
+        case OP_ST:
+            st(vm, instruction);
+            break;
+        case OP_JSR:
+            jsr(vm, instruction);
+            (void)CHECKPOINT(vm);
+            break;
+        case OP_AND:
+            and(vm, instruction);
+            break;
+        case OP_LDR:
+            ldr(vm, instruction);
+            break;
+        case OP_STR:
+            str(vm, instruction);
+            break;
+        case OP_RTI:
+            rti(vm, instruction);
+            break;
+        case OP_NOT:
+            not(vm, instruction);
+            break;
+        case OP_LDI:
+            ldi(vm, instruction);
+            break;
+        case OP_STI:
+            sti(vm, instruction);
+            break;
+        case OP_JMP:
+            jmp(vm, instruction);
+            (void)CHECKPOINT(vm);
+            break;
+        case OP_RES:
+            res(vm, instruction);
+            break;
+        case OP_LEA:
+            lea(vm, instruction);
+            break;
+        case OP_TRAP:
+            trap(vm, instruction);
+            break;
+        default:
+            // Bad Opcode
+            abort();
+            break;
+    }
+}
+
+
+void run_switch(struct vm* vm) {
+    while(vm->running) {
+        // Fetch an instruction
+        uint16_t instruction = mem_fetch(vm, vm->reg[R_PC]++);
+        ++vm->instructions;
+        execute(vm, instruction);
+    }
+}
+
+
+#ifdef HAVE_HANDLER_TABLE
+#include "lc3-handlers.h"
+
+// run_switch() with the switch replaced by a call through the handler of the whole word
+void run_table(struct vm* vm) {
+    while (vm->running) {
+        uint16_t instruction = mem_fetch(vm, vm->reg[R_PC]++);
+        ++vm->instructions;
+        handler_table[instruction](vm);
+    }
+}
+#endif
+
+
+struct vm* volatile profiled_vm;
+
+// run_switch() with the counters of vm->profile, used for every engine under --profile
+void run_profiled(struct vm* vm) {
+    struct profile* profile = vm->profile;
+    while (vm->running) {
+        uint16_t pc = vm->reg[R_PC];
+        uint16_t instruction = mem_fetch(vm, vm->reg[R_PC]++);
+        ++vm->instructions;
+        ++profile->executed[pc];
+        ++profile->opcodes[instruction >> 12];
+        if ((instruction >> 12) == OP_BR && ((instruction >> 9) & 0x7 & cond_flags(vm))) {
+            ++profile->taken[pc];
+        }
+        execute(vm, instruction);
+    }
+}
+
+
+#ifdef HAVE_COMPUTED_GOTO
+void run_threaded(struct vm* vm) {
+    // Indexed by opcode, must stay in the same order as enum operations
+    static void* const dispatch_table[16] = {
+        &&op_br, &&op_add, &&op_ld, &&op_st, &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_rti, &&op_not, &&op_ldi, &&op_sti, &&op_jmp, &&op_res, &&op_lea, &&op_trap
+    };
+    uint16_t instruction;
+
+    // Every handler ends with its own copy of the fetch and jump, so the branch predictor gets one
+    //  indirect branch per handler instead of one shared by all of them
+#define DISPATCH() do {                                 \
+        instruction = mem_fetch(vm, vm->reg[R_PC]++);    \
+        ++vm->instructions;                             \
+        goto *dispatch_table[instruction >> 12];        \
+    } while (0)
+#define CHECKED_DISPATCH() do {                         \
+        if (!CHECKPOINT(vm)) {                          \
+            return;                                     \
+        }                                               \
+        DISPATCH();                                     \
+    } while (0)
+    // A store to a device can stop the machine
+#define STORE_DISPATCH(store) do {                      \
+        if (!(store)) {                                 \
+            return;                                     \
+        }                                               \
+        DISPATCH();                                     \
+    } while (0)
+
+    if (!vm->running) {
+        return;
+    }
+    DISPATCH();
+
+op_br:   br(vm, instruction);   CHECKED_DISPATCH();
+op_add:  add(vm, instruction);  DISPATCH();
+op_ld:   ld(vm, instruction);   DISPATCH();
+op_st:   STORE_DISPATCH(st(vm, instruction));
+op_jsr:  jsr(vm, instruction);  CHECKED_DISPATCH();
+op_and:  and(vm, instruction);  DISPATCH();
+op_ldr:  ldr(vm, instruction);  DISPATCH();
+op_str:  STORE_DISPATCH(str(vm, instruction));
+op_rti:  rti(vm, instruction);  DISPATCH();
+op_not:  not(vm, instruction);  DISPATCH();
+op_ldi:  ldi(vm, instruction);  DISPATCH();
+op_sti:  STORE_DISPATCH(sti(vm, instruction));
+op_jmp:  jmp(vm, instruction);  CHECKED_DISPATCH();
+op_res:  res(vm, instruction);  DISPATCH();
+op_lea:  lea(vm, instruction);  DISPATCH();
+op_trap:
+    // HALT is the only way to stop, so running only needs checking after a trap
+    trap(vm, instruction);
+    if (!vm->running) {
+        return;
+    }
+    DISPATCH();
+
+#undef DISPATCH
+#undef CHECKED_DISPATCH
+#undef STORE_DISPATCH
+}
+#endif
+
+
+void decode_instruction(struct decoded* d, uint16_t addr, uint16_t instruction) {
+    uint16_t pc = addr + 1;
+
+    d->r0 = (instruction >> 9) & 0x7;
+    d->r1 = (instruction >> 6) & 0x7;
+    d->r2 = instruction & 0x7;
+    d->imm = 0;
+
+    switch (instruction >> 12) {
+        case OP_BR:
+            d->id = D_BR;
+            d->imm = pc + sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_ADD:
+            d->id = ((instruction >> 5) & 0x1) ? D_ADD_IMM : D_ADD_REG;
+            d->imm = sign_extend(instruction & 0x1F, 5);
+            break;
+        case OP_LD:
+            d->id = D_LD;
+            d->imm = pc + sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_ST:
+            d->id = D_ST;
+            d->imm = pc + sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_JSR:
+            d->id = ((instruction >> 11) & 0x1) ? D_JSR : D_JSRR;
+            d->imm = pc + sign_extend(instruction & 0x7FF, 11);
+            break;
+        case OP_AND:
+            d->id = ((instruction >> 5) & 0x1) ? D_AND_IMM : D_AND_REG;
+            d->imm = sign_extend(instruction & 0x1F, 5);
+            break;
+        case OP_LDR:
+            d->id = D_LDR;
+            d->imm = sign_extend(instruction & 0x3F, 6);
+            break;
+        case OP_STR:
+            d->id = D_STR;
+            d->imm = sign_extend(instruction & 0x3F, 6);
+            break;
+        case OP_RTI:
+            d->id = D_RTI;
+            break;
+        case OP_NOT:
+            d->id = D_NOT;
+            break;
+        case OP_LDI:
+            d->id = D_LDI;
+            d->imm = pc + sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_STI:
+            d->id = D_STI;
+            d->imm = pc + sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_JMP:
+            d->id = D_JMP;
+            break;
+        case OP_RES:
+            d->id = D_RES;
+            break;
+        case OP_LEA:
+            d->id = D_LEA;
+            d->imm = pc + sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_TRAP:
+            d->id = D_TRAP;
+            d->imm = instruction & 0xFF;
+            break;
+    }
+}
+
+int ram_access_id(struct vm* vm, uint16_t addr, const struct decoded* d);
+
+void decode(struct vm* vm, uint16_t addr) {
+    struct decoded* d = &vm->decoded[addr];
+    decode_instruction(d, addr, mem_fetch(vm, addr));
+    d->id = ram_access_id(vm, addr, d);
+    mark_code(vm, addr, CODE_DECODED);
+}
+
+
+// The decoded engine is written once against these macros: computed gotos when they are
+//  available, a plain switch otherwise
+#ifdef HAVE_COMPUTED_GOTO
+#define D_START()       D_NEXT();
+#define D_END()
+#define D_CASE(id)      L_##id:
+#define D_NEXT()        do { ++instructions; d = &decoded[pc++]; goto *labels[d->id]; } while (0)
+#define D_AGAIN()       goto *labels[d->id]
+#else
+#define D_START()       for (;;) { ++instructions; d = &decoded[pc++]; again: switch (d->id) {
+#define D_END()         } }
+#define D_CASE(id)      case id:
+#define D_NEXT()        continue
+#define D_AGAIN()       goto again
+#endif
+
+// Puts the PC and the count back into the vm before looking at the budget
+#define D_CHECKPOINT() do {                                 \
+        if (instructions >= vm->check_at) {                 \
+            vm->reg[R_PC] = pc;                             \
+            vm->instructions = instructions;                \
+            if (!budget_check(vm)) {                        \
+                return;                                     \
+            }                                               \
+        }                                                   \
+    } while (0)
+
+// Same as jsr() under --sample and --callgraph. The PC is published for the sampler, so the PC it
+//  takes is at least in the routine on top of the stack.
+#define D_FOLLOW_CALL() do {                                \
+        if (vm->calls) {                                    \
+            vm->reg[R_PC] = pc;                             \
+            call_enter(vm->calls, pc, vm->reg[R_R7], instructions); \
+        }                                                   \
+    } while (0)
+
+// A store to a device can stop the machine
+#define D_STORE(addr, val) do {                             \
+        if (!mem_write(vm, addr, val)) {                    \
+            vm->reg[R_PC] = pc;                             \
+            vm->instructions = instructions;                \
+            return;                                         \
+        }                                                   \
+    } while (0)
+
+void run_decoded(struct vm* vm) {
+#ifdef HAVE_COMPUTED_GOTO
+    // Indexed by enum decoded_ids
+    static void* const labels[D_COUNT] = {
+        &&L_D_UNDECODED, &&L_D_BR, &&L_D_ADD_REG, &&L_D_ADD_IMM, &&L_D_LD, &&L_D_ST,
+        &&L_D_JSR, &&L_D_JSRR, &&L_D_AND_REG, &&L_D_AND_IMM, &&L_D_LDR, &&L_D_STR,
+        &&L_D_RTI, &&L_D_NOT, &&L_D_LDI, &&L_D_STI, &&L_D_JMP, &&L_D_RES, &&L_D_LEA, &&L_D_TRAP,
+        &&L_D_LD_RAM, &&L_D_ST_RAM, &&L_D_LDR_RAM, &&L_D_STR_RAM
+    };
+#endif
+    struct decoded* d;
+
+    if (!vm->running) {
+        return;
+    }
+    if (!vm->decoded) {
+        vm->decoded = calloc(MEMORY_MAX, sizeof(struct decoded));
+        if (!vm->decoded) {
+            printf("Failed to allocate the decoded instruction cache\n");
+            vm->running = 0;
+            return;
+        }
+    }
+
+    // The PC and the instruction count only live in the vm while a trap runs and once the loop
+    //  is left
+    struct decoded* decoded = vm->decoded;
+    uint16_t pc = vm->reg[R_PC];
+    uint64_t instructions = vm->instructions;
+
+    D_START()
+
+    D_CASE(D_UNDECODED)
+        // First fetch of this word (or it was overwritten): decode it and run it from the record
+        decode(vm, pc - 1);
+        D_AGAIN();
+    D_CASE(D_BR)
+        if (d->r0 & cond_flags(vm)) {
+            pc = d->imm;
+        }
+        D_CHECKPOINT();
+        D_NEXT();
+    D_CASE(D_ADD_REG)
+        vm->reg[d->r0] = vm->reg[d->r1] + vm->reg[d->r2];
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_ADD_IMM)
+        vm->reg[d->r0] = vm->reg[d->r1] + d->imm;
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_LD)
+        // Loads publish the PC for is_poll_loop()
+        vm->reg[R_PC] = pc;
+        vm->reg[d->r0] = mem_read(vm, d->imm);
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_ST)
+        D_STORE(d->imm, vm->reg[d->r0]);
+        D_NEXT();
+    D_CASE(D_JSR)
+        vm->reg[R_R7] = pc;
+        pc = d->imm;
+        D_FOLLOW_CALL();
+        D_CHECKPOINT();
+        D_NEXT();
+    D_CASE(D_JSRR)
+        // R7 is written first, same as jsr(), so JSRR R7 falls through
+        vm->reg[R_R7] = pc;
+        pc = vm->reg[d->r1];
+        D_FOLLOW_CALL();
+        D_CHECKPOINT();
+        D_NEXT();
+    D_CASE(D_AND_REG)
+        vm->reg[d->r0] = vm->reg[d->r1] & vm->reg[d->r2];
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_AND_IMM)
+        vm->reg[d->r0] = vm->reg[d->r1] & d->imm;
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_LDR)
+        vm->reg[R_PC] = pc;
+        vm->reg[d->r0] = mem_read(vm, vm->reg[d->r1] + d->imm);
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_STR)
+        D_STORE(vm->reg[d->r1] + d->imm, vm->reg[d->r0]);
+        D_NEXT();
+    D_CASE(D_RTI)
+        illegal_instruction(vm);
+    D_CASE(D_NOT)
+        vm->reg[d->r0] = ~vm->reg[d->r1];
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_LDI)
+        vm->reg[R_PC] = pc;
+        vm->reg[d->r0] = mem_read(vm, mem_read(vm, d->imm));
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_STI)
+        D_STORE(mem_read(vm, d->imm), vm->reg[d->r0]);
+        D_NEXT();
+    D_CASE(D_JMP)
+        pc = vm->reg[d->r1];
+        if (vm->calls && d->r1 == R_R7) {
+            vm->reg[R_PC] = pc;
+            call_return(vm->calls, pc, instructions);
+        }
+        D_CHECKPOINT();
+        D_NEXT();
+    D_CASE(D_RES)
+        illegal_instruction(vm);
+    D_CASE(D_LEA)
+        vm->reg[d->r0] = d->imm;
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_TRAP)
+        vm->reg[R_PC] = pc;
+        vm->instructions = instructions;
+        trap(vm, d->imm);
+        if (!vm->running) {
+            return;
+        }
+        D_NEXT();
+    D_CASE(D_LD_RAM)
+        vm->reg[d->r0] = vm->memory[d->imm];
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_ST_RAM)
+        ram_write(vm, d->imm, vm->reg[d->r0]);
+        D_NEXT();
+    D_CASE(D_LDR_RAM)
+        vm->reg[d->r0] = vm->memory[(uint16_t)(vm->reg[d->r1] + d->imm)];
+        update_flags(vm, d->r0);
+        D_NEXT();
+    D_CASE(D_STR_RAM)
+        ram_write(vm, vm->reg[d->r1] + d->imm, vm->reg[d->r0]);
+        D_NEXT();
+
+    D_END()
+}
+
+#undef D_START
+#undef D_END
+#undef D_CASE
+#undef D_NEXT
+#undef D_AGAIN
+#undef D_CHECKPOINT
+#undef D_FOLLOW_CALL
+#undef D_STORE
+
+
+void jit_flush(struct vm* vm);
+int analyze_code(struct vm* vm);
+void drop_analysis(struct vm* vm);
+
+void flush_blocks(struct vm* vm) {
+    struct block_cache* cache = vm->blocks;
+    if (cache) {
+        for (int i = 0; i < cache->count; ++i) {
+            uint16_t addr = cache->blocks[i].start;
+            cache->map[addr] = NULL;
+            for (int n = 0; n < cache->blocks[i].length; ++n) {
+                vm->code_map[addr++] &= ~CODE_TRANSLATED;
+            }
+        }
+        cache->count = 0;
+        cache->op_count = 0;
+        ++cache->generation;
+    }
+#ifdef HAVE_JIT
+    if (vm->jit) {
+        jit_flush(vm);
+    }
+#endif
+}
+
+// Called by mem_write when a store hits a word that some engine has cached
+void invalidate_code(struct vm* vm, uint16_t addr) {
+    if (vm->code_map[addr] & CODE_ANALYZED) {
+        drop_analysis(vm);
+    }
+    if (vm->code_map[addr] & CODE_DECODED) {
+        vm->decoded[addr].id = D_UNDECODED;
+        vm->code_map[addr] &= ~CODE_DECODED;
+    }
+    if (vm->code_map[addr] & CODE_TRANSLATED) {
+        flush_blocks(vm);
+    }
+}
+
+
+// Also used by the profiler to cut its report into blocks
+int ends_block(int id) {
+    switch (id) {
+        case D_BR:
+        case D_JSR:
+        case D_JSRR:
+        case D_JMP:
+        case D_TRAP:
+        case D_RTI:
+        case D_RES:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+
+#ifdef HAVE_COMPUTED_GOTO
+#define FUSED_ID(a, b)          B_##a##_##b,
+#define FUSED_TRIPLE_ID(a, b, c) B_##a##_##b##_##c,
+enum {
+    B_FALLTHROUGH = D_COUNT,        // Ends a block that hit BLOCK_MAX_LENGTH
+    FUSION_PAIRS(FUSED_ID)
+    FUSION_TRIPLES(FUSED_TRIPLE_ID)
+    B_COUNT
+};
+#undef FUSED_ID
+#undef FUSED_TRIPLE_ID
+
+#define FUSED_PAIR(a, b)        [D_##a][D_##b] = B_##a##_##b,
+#define FUSED_TRIPLE(a, b, c)   {D_##a, D_##b, D_##c, B_##a##_##b##_##c},
+// Handler of the superinstruction starting with the ids, or 0
+const uint8_t fused_pairs[D_COUNT][D_COUNT] = { FUSION_PAIRS(FUSED_PAIR) };
+const uint8_t fused_triples[][4] = { FUSION_TRIPLES(FUSED_TRIPLE) };
+#undef FUSED_PAIR
+#undef FUSED_TRIPLE
+
+// Points the first op of every fusable sequence at its superinstruction, left to right, triples
+//  first. The ops inside a sequence keep their own handlers, the superinstruction jumps into the
+//  last one.
+void fuse_ops(struct block_op* ops, const uint8_t* ids, int count, void* const* labels) {
+    int i = 0;
+    while (i + 1 < count) {
+        int fused = 0;
+        for (size_t t = 0; i + 2 < count && t < sizeof(fused_triples) / sizeof(fused_triples[0]); ++t) {
+            if (fused_triples[t][0] == ids[i] && fused_triples[t][1] == ids[i + 1] &&
+                fused_triples[t][2] == ids[i + 2]) {
+                ops[i].handler = labels[fused_triples[t][3]];
+                fused = 3;
+                break;
+            }
+        }
+        if (!fused && fused_pairs[ids[i]][ids[i + 1]]) {
+            ops[i].handler = labels[fused_pairs[ids[i]][ids[i + 1]]];
+            fused = 2;
+        }
+        i += fused ? fused : 1;
+    }
+}
+
+struct block* translate_block(struct vm* vm, uint16_t pc, void* const* labels) {
+    struct block_cache* cache = vm->blocks;
+    if (cache->count == BLOCK_MAX_COUNT || cache->op_count + BLOCK_MAX_LENGTH + 1 > BLOCK_MAX_OPS) {
+        flush_blocks(vm);
+    }
+
+    struct block* b = &cache->blocks[cache->count++];
+    b->start = pc;
+    b->length = 0;
+    b->ops = &cache->ops[cache->op_count];
+    b->taken = NULL;
+    b->next = NULL;
+
+    struct decoded d;
+    struct block_op* op = b->ops;
+    uint8_t ids[BLOCK_MAX_LENGTH];
+    do {
+        decode_instruction(&d, pc, mem_fetch(vm, pc));
+        mark_code(vm, pc, CODE_TRANSLATED);
+        ids[b->length] = ram_access_id(vm, pc, &d);
+        op->handler = labels[ids[b->length]];
+        ++pc;
+
+        op->next_pc = pc;
+        op->r0 = d.r0;
+        op->r1 = d.r1;
+        op->r2 = d.r2;
+        op->imm = d.imm;
+        ++op;
+        ++b->length;
+    } while (!ends_block(d.id) && b->length < BLOCK_MAX_LENGTH);
+
+    if (!ends_block(d.id)) {
+        op->handler = labels[B_FALLTHROUGH];
+        op->next_pc = pc;
+        ++op;
+    }
+    fuse_ops(b->ops, ids, b->length, labels);
+    cache->op_count += op - b->ops;
+    cache->map[b->start] = b;
+    return b;
+}
+
+struct block* find_block(struct vm* vm, uint16_t pc, void* const* labels) {
+    struct block* b = vm->blocks->map[pc];
+    if (!b) {
+        b = translate_block(vm, pc, labels);
+    }
+    return b;
+}
+
+void run_blocks(struct vm* vm) {
+#define FUSED_LABEL(a, b)           &&L_##a##_##b,
+#define FUSED_TRIPLE_LABEL(a, b, c) &&L_##a##_##b##_##c,
+    // Indexed by enum decoded_ids, followed by the block only ops
+    static void* const labels[B_COUNT] = {
+        &&L_UNDECODED, &&L_BR, &&L_ADD_REG, &&L_ADD_IMM, &&L_LD, &&L_ST,
+        &&L_JSR, &&L_JSRR, &&L_AND_REG, &&L_AND_IMM, &&L_LDR, &&L_STR,
+        &&L_RTI, &&L_NOT, &&L_LDI, &&L_STI, &&L_JMP, &&L_RES, &&L_LEA, &&L_TRAP,
+        &&L_LD_RAM, &&L_ST_RAM, &&L_LDR_RAM, &&L_STR_RAM,
+        &&L_FALLTHROUGH,
+        FUSION_PAIRS(FUSED_LABEL)
+        FUSION_TRIPLES(FUSED_TRIPLE_LABEL)
+    };
+#undef FUSED_LABEL
+#undef FUSED_TRIPLE_LABEL
+    struct block* b;
+    struct block** link;
+    const struct block_op* op;
+    uint32_t generation;
+
+    if (!vm->running) {
+        return;
+    }
+    if (!vm->blocks) {
+        vm->blocks = calloc(1, sizeof(struct block_cache));
+        if (!vm->blocks) {
+            printf("Failed to allocate the block cache\n");
+            vm->running = 0;
+            return;
+        }
+    }
+    struct block_cache* cache = vm->blocks;
+
+    // The PC is only written back to reg[R_PC] when a block is left, and a block counts all its
+    //  instructions when it is entered. Stores check the generation so a block that overwrites its
+    //  own code, or a store that stops the machine, leaves right after the store, taking back
+    //  the instructions it skipped.
+#define NEXT()      do { ++op; goto *op->handler; } while (0)
+#define STORE_CHECK(store) do {                                 \
+        int running = (store);                                  \
+        if (cache->generation != generation || !running) {      \
+            vm->instructions -= b->ops + b->length - op - 1;    \
+            vm->reg[R_PC] = op->next_pc;                        \
+            if (!running) {                                     \
+                return;                                         \
+            }                                                   \
+            goto lookup;                                        \
+        }                                                       \
+    } while (0)
+
+    // The bodies of the handlers that can start a superinstruction
+#define DO_ADD_REG()    do { vm->reg[op->r0] = vm->reg[op->r1] + vm->reg[op->r2]; update_flags(vm, op->r0); } while (0)
+#define DO_ADD_IMM()    do { vm->reg[op->r0] = vm->reg[op->r1] + op->imm; update_flags(vm, op->r0); } while (0)
+#define DO_AND_REG()    do { vm->reg[op->r0] = vm->reg[op->r1] & vm->reg[op->r2]; update_flags(vm, op->r0); } while (0)
+#define DO_AND_IMM()    do { vm->reg[op->r0] = vm->reg[op->r1] & op->imm; update_flags(vm, op->r0); } while (0)
+#define DO_NOT()        do { vm->reg[op->r0] = ~vm->reg[op->r1]; update_flags(vm, op->r0); } while (0)
+#define DO_LEA()        do { vm->reg[op->r0] = op->imm; update_flags(vm, op->r0); } while (0)
+    // Loads publish the PC for is_poll_loop()
+#define DO_LD()         do {                                    \
+        vm->reg[R_PC] = op->next_pc;                            \
+        vm->reg[op->r0] = mem_read(vm, op->imm);                \
+        update_flags(vm, op->r0);                               \
+    } while (0)
+#define DO_LDR()        do {                                    \
+        vm->reg[R_PC] = op->next_pc;                            \
+        vm->reg[op->r0] = mem_read(vm, vm->reg[op->r1] + op->imm); \
+        update_flags(vm, op->r0);                               \
+    } while (0)
+#define DO_LDI()        do {                                    \
+        vm->reg[R_PC] = op->next_pc;                            \
+        vm->reg[op->r0] = mem_read(vm, mem_read(vm, op->imm));  \
+        update_flags(vm, op->r0);                               \
+    } while (0)
+#define DO_LD_RAM()     do { vm->reg[op->r0] = vm->memory[op->imm]; update_flags(vm, op->r0); } while (0)
+#define DO_LDR_RAM()    do {                                    \
+        vm->reg[op->r0] = vm->memory[(uint16_t)(vm->reg[op->r1] + op->imm)]; \
+        update_flags(vm, op->r0);                               \
+    } while (0)
+#define DO_ST()         STORE_CHECK(mem_write(vm, op->imm, vm->reg[op->r0]))
+#define DO_STR()        STORE_CHECK(mem_write(vm, vm->reg[op->r1] + op->imm, vm->reg[op->r0]))
+#define DO_STI()        STORE_CHECK(mem_write(vm, mem_read(vm, op->imm), vm->reg[op->r0]))
+#define DO_ST_RAM()     do { ram_write(vm, op->imm, vm->reg[op->r0]); STORE_CHECK(1); } while (0)
+#define DO_STR_RAM()    do { ram_write(vm, vm->reg[op->r1] + op->imm, vm->reg[op->r0]); STORE_CHECK(1); } while (0)
+
+lookup:
+    b = find_block(vm, vm->reg[R_PC], labels);
+    generation = cache->generation;
+enter:
+    // Every way in has written the block's address to reg[R_PC]
+    if (!CHECKPOINT(vm)) {
+        return;
+    }
+    vm->instructions += b->length;
+    op = b->ops;
+    goto *op->handler;
+
+L_UNDECODED:
+    // Never translated into a block
+    abort();
+L_ADD_REG:  DO_ADD_REG();   NEXT();
+L_ADD_IMM:  DO_ADD_IMM();   NEXT();
+L_AND_REG:  DO_AND_REG();   NEXT();
+L_AND_IMM:  DO_AND_IMM();   NEXT();
+L_NOT:      DO_NOT();       NEXT();
+L_LEA:      DO_LEA();       NEXT();
+L_LD:       DO_LD();        NEXT();
+L_LDR:      DO_LDR();       NEXT();
+L_LDI:      DO_LDI();       NEXT();
+L_LD_RAM:   DO_LD_RAM();    NEXT();
+L_LDR_RAM:  DO_LDR_RAM();   NEXT();
+L_ST:       DO_ST();        NEXT();
+L_STR:      DO_STR();       NEXT();
+L_STI:      DO_STI();       NEXT();
+L_ST_RAM:   DO_ST_RAM();    NEXT();
+L_STR_RAM:  DO_STR_RAM();   NEXT();
+
+    // Superinstructions: the leading bodies inline, then straight into the last handler. op moves
+    //  along so every body sees its own fields.
+#define FUSED_HANDLER(a, b)         L_##a##_##b: DO_##a(); ++op; goto L_##b;
+#define FUSED_TRIPLE_HANDLER(a, b, c) L_##a##_##b##_##c: DO_##a(); ++op; DO_##b(); ++op; goto L_##c;
+    FUSION_PAIRS(FUSED_HANDLER)
+    FUSION_TRIPLES(FUSED_TRIPLE_HANDLER)
+#undef FUSED_HANDLER
+#undef FUSED_TRIPLE_HANDLER
+
+    // Block terminators: work out the next PC, then follow (or create) the chain link
+L_BR:
+    if (op->r0 & cond_flags(vm)) {
+        vm->reg[R_PC] = op->imm;
+        link = &b->taken;
+    } else {
+        vm->reg[R_PC] = op->next_pc;
+        link = &b->next;
+    }
+    goto chain;
+L_JSR:
+    vm->reg[R_R7] = op->next_pc;
+    vm->reg[R_PC] = op->imm;
+    if (vm->calls) {
+        call_enter(vm->calls, vm->reg[R_PC], vm->reg[R_R7], vm->instructions);
+    }
+    link = &b->taken;
+    goto chain;
+L_JSRR:
+    // R7 is written first, same as jsr(), so JSRR R7 falls through
+    vm->reg[R_R7] = op->next_pc;
+    vm->reg[R_PC] = vm->reg[op->r1];
+    if (vm->calls) {
+        call_enter(vm->calls, vm->reg[R_PC], vm->reg[R_R7], vm->instructions);
+    }
+    goto lookup;
+L_JMP:
+    vm->reg[R_PC] = vm->reg[op->r1];
+    if (vm->calls && op->r1 == R_R7) {
+        call_return(vm->calls, vm->reg[R_PC], vm->instructions);
+    }
+    goto lookup;
+L_TRAP:
+    vm->reg[R_PC] = op->next_pc;
+    trap(vm, op->imm);
+    if (!vm->running) {
+        return;
+    }
+    link = &b->next;
+    goto chain;
+L_FALLTHROUGH:
+    vm->reg[R_PC] = op->next_pc;
+    link = &b->next;
+    goto chain;
+L_RTI:
+    illegal_instruction(vm);
+L_RES:
+    illegal_instruction(vm);
+
+chain:
+    if (*link) {
+        b = *link;
+        goto enter;
+    }
+    b = find_block(vm, vm->reg[R_PC], labels);
+    // Translating the successor may have flushed the cache, and *link with it
+    if (cache->generation == generation) {
+        *link = b;
+    }
+    generation = cache->generation;
+    goto enter;
+
+#undef NEXT
+#undef STORE_CHECK
+#undef DO_ADD_REG
+#undef DO_ADD_IMM
+#undef DO_AND_REG
+#undef DO_AND_IMM
+#undef DO_NOT
+#undef DO_LEA
+#undef DO_LD
+#undef DO_LDR
+#undef DO_LDI
+#undef DO_LD_RAM
+#undef DO_LDR_RAM
+#undef DO_ST
+#undef DO_STR
+#undef DO_STI
+#undef DO_ST_RAM
+#undef DO_STR_RAM
+}
+#endif
+
+
+/****************************************************************************************************
+ *                                  Start of x86-64 JIT                                             *
+ ***************************************************************************************************/
+#ifdef HAVE_JIT
+// Blocks that have been entered JIT_THRESHOLD times are compiled to x86-64. Inside compiled code
+//  the guest registers R0-R7 live zero extended in r8d-r15d, and the condition codes are kept as
+//  the value of the last flag setting instruction in edx, only turned into FL_* when the code
+//  returns to C. Compiled blocks jump straight into each other through jit->entry; anything they
+//  can not handle (traps, the device page, stores into translated code) returns to run_jit() to
+//  be interpreted.
+enum {
+    JIT_BUFFER_SIZE    = 8 << 20,
+    JIT_MAX_BLOCKS     = 1 << 14,
+    JIT_MAX_LENGTH     = 64,
+    JIT_MAX_BLOCK_CODE = JIT_MAX_LENGTH * 128,    // Upper bound on the code for one block
+    JIT_MAX_EXITS      = JIT_MAX_LENGTH * 2 + 4,
+    JIT_THRESHOLD      = 50,
+    JIT_MAX_FLUSHES    = 8,                       // Stop compiling blocks that keep being flushed
+                                                  //  by self-modifying code
+    JIT_DEVICE_PAGE    = 0xFE00,                  // Loads and stores at or above this are interpreted
+    JIT_SIDE_EXIT      = 1 << 16                  // Set in the exit value when the next instruction
+                                                  //  has to be interpreted
+};
+
+// Host registers
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+#define HOST(r) (8 + (r))
+
+// x86 condition codes, for jcc
+enum { CC_AE = 0x3, CC_Z = 0x4, CC_NZ = 0x5, CC_S = 0x8, CC_NS = 0x9, CC_LE = 0xE, CC_G = 0xF };
+
+typedef uint32_t (*jit_enter_fn)(uint16_t* reg, uint16_t* memory, void** entry, uint8_t* code_map,
+                                 void* target);
+
+// An out of line exit stub still to be written at the end of the block
+struct jit_exit {
+    uint8_t* patch;         // rel32 to point at the stub
+    uint32_t value;         // PC (| JIT_SIDE_EXIT) to return
+    int flag;               // Guest register holding the last result, -1 when it is in edx already
+};
+
+struct jit {
+    uint8_t* buffer;        // mmap'd, either writable or executable, never both
+    uint8_t* code;          // Next free byte
+    uint8_t* blocks_start;  // First byte after the enter/exit stubs
+    uint8_t* exit;          // Common exit stub
+    jit_enter_fn enter;
+    void* entry[MEMORY_MAX];            // Compiled code for each guest address, or NULL
+    uint16_t hits[MEMORY_MAX];
+    uint8_t flushes[MEMORY_MAX];
+    uint16_t starts[JIT_MAX_BLOCKS];
+    uint16_t lengths[JIT_MAX_BLOCKS];
+    int count;
+    struct jit_exit exits[JIT_MAX_EXITS];
+    int exit_count;
+};
+
+
+void emit8(struct jit* jit, uint8_t b) {
+    *jit->code++ = b;
+}
+
+void emit32(struct jit* jit, uint32_t v) {
+    memcpy(jit->code, &v, sizeof(v));
+    jit->code += sizeof(v);
+}
+
+void emit_rex(struct jit* jit, int w, int r, int x, int b) {
+    uint8_t rex = 0x40 | (w << 3) | ((r >> 3) << 2) | ((x >> 3) << 1) | (b >> 3);
+    if (rex != 0x40) {
+        emit8(jit, rex);
+    }
+}
+
+void emit_modrm_reg(struct jit* jit, int reg, int rm) {
+    emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + index * scale + disp32], index < 0 for no index
+void emit_modrm_mem(struct jit* jit, int reg, int base, int index, int scale, int32_t disp) {
+    if (index < 0 && (base & 7) != RSP) {
+        emit8(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+    } else {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        emit8(jit, 0x80 | ((reg & 7) << 3) | RSP);
+        emit8(jit, (ss << 6) | (((index < 0 ? RSP : index) & 7) << 3) | (base & 7));
+    }
+    emit32(jit, disp);
+}
+
+// add/and r/m16, r16
+void emit_alu16_rr(struct jit* jit, uint8_t opcode, int dst, int src) {
+    emit8(jit, 0x66);
+    emit_rex(jit, 0, src, 0, dst);
+    emit8(jit, opcode);
+    emit_modrm_reg(jit, src, dst);
+}
+
+// add/and r/m16, imm8 (sign extended), ext is the ModRM.reg opcode extension
+void emit_alu16_ri(struct jit* jit, int ext, int dst, int8_t imm) {
+    emit8(jit, 0x66);
+    emit_rex(jit, 0, 0, 0, dst);
+    emit8(jit, 0x83);
+    emit_modrm_reg(jit, ext, dst);
+    emit8(jit, imm);
+}
+
+void emit_not16(struct jit* jit, int dst) {
+    emit8(jit, 0x66);
+    emit_rex(jit, 0, 0, 0, dst);
+    emit8(jit, 0xF7);
+    emit_modrm_reg(jit, 2, dst);
+}
+
+void emit_test16(struct jit* jit, int r) {
+    emit8(jit, 0x66);
+    emit_rex(jit, 0, r, 0, r);
+    emit8(jit, 0x85);
+    emit_modrm_reg(jit, r, r);
+}
+
+void emit_mov32_rr(struct jit* jit, int dst, int src) {
+    emit_rex(jit, 0, src, 0, dst);
+    emit8(jit, 0x89);
+    emit_modrm_reg(jit, src, dst);
+}
+
+void emit_mov32_ri(struct jit* jit, int dst, uint32_t imm) {
+    emit_rex(jit, 0, 0, 0, dst);
+    emit8(jit, 0xB8 + (dst & 7));
+    emit32(jit, imm);
+}
+
+// movzx dst32, word [mem]
+void emit_load16(struct jit* jit, int dst, int base, int index, int scale, int32_t disp) {
+    emit_rex(jit, 0, dst, index < 0 ? 0 : index, base);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB7);
+    emit_modrm_mem(jit, dst, base, index, scale, disp);
+}
+
+// mov word [mem], src16
+void emit_store16(struct jit* jit, int src, int base, int index, int scale, int32_t disp) {
+    emit8(jit, 0x66);
+    emit_rex(jit, 0, src, index < 0 ? 0 : index, base);
+    emit8(jit, 0x89);
+    emit_modrm_mem(jit, src, base, index, scale, disp);
+}
+
+// eax = (base + disp) & 0xFFFF
+void emit_address(struct jit* jit, int base, int16_t disp) {
+    emit_rex(jit, 0, RAX, 0, base);
+    emit8(jit, 0x8D);
+    emit_modrm_mem(jit, RAX, base, -1, 1, disp);
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB7);
+    emit_modrm_reg(jit, RAX, RAX);
+}
+
+// Returns the rel32 field to patch
+uint8_t* emit_jcc(struct jit* jit, int cc) {
+    emit8(jit, 0x0F);
+    emit8(jit, 0x80 + cc);
+    emit32(jit, 0);
+    return jit->code - 4;
+}
+
+uint8_t* emit_jmp(struct jit* jit) {
+    emit8(jit, 0xE9);
+    emit32(jit, 0);
+    return jit->code - 4;
+}
+
+void patch_rel32(uint8_t* at, uint8_t* target) {
+    int32_t rel = (int32_t)(target - (at + 4));
+    memcpy(at, &rel, sizeof(rel));
+}
+
+void emit_jmp_to(struct jit* jit, uint8_t* target) {
+    patch_rel32(emit_jmp(jit), target);
+}
+
+
+// Moves the last flag result into edx, needed before leaving the block or clobbering the register
+void emit_flags(struct jit* jit, int* flag) {
+    if (*flag >= 0) {
+        emit_mov32_rr(jit, RDX, HOST(*flag));
+        *flag = -1;
+    }
+}
+
+void add_exit(struct jit* jit, uint8_t* patch, uint32_t value, int flag) {
+    struct jit_exit* e = &jit->exits[jit->exit_count++];
+    e->patch = patch;
+    e->value = value;
+    e->flag = flag;
+}
+
+// add/sub qword [rdi + offsetof(struct vm, instructions)], imm32. Returns the imm32 to patch
+uint8_t* emit_count(struct jit* jit, int ext, uint32_t n) {
+    emit_rex(jit, 1, 0, 0, RDI);
+    emit8(jit, 0x81);
+    emit_modrm_mem(jit, ext, RDI, -1, 1, offsetof(struct vm, instructions));
+    emit32(jit, n);
+    return jit->code - 4;
+}
+
+// Leaves the block to be continued by the interpreter at pc
+void emit_side_exit(struct jit* jit, uint16_t pc, int* flag) {
+    emit_flags(jit, flag);
+    emit_mov32_ri(jit, RAX, pc | JIT_SIDE_EXIT);
+    emit_jmp_to(jit, jit->exit);
+}
+
+// Continues at a PC known when compiling: jump there directly if it is already compiled, otherwise
+//  go through jit->entry so it is picked up once it has been compiled
+void emit_chain(struct jit* jit, uint16_t pc, uint8_t* block, uint16_t start, int* flag) {
+    emit_flags(jit, flag);
+    if (pc == start) {
+        emit_jmp_to(jit, block);
+    } else if (jit->entry[pc]) {
+        emit_jmp_to(jit, jit->entry[pc]);
+    } else {
+        // mov rax, [rbx + pc * 8]; test rax, rax; jz exit; jmp rax
+        emit_rex(jit, 1, RAX, 0, RBX);
+        emit8(jit, 0x8B);
+        emit_modrm_mem(jit, RAX, RBX, -1, 1, pc * 8);
+        emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xC0);
+        add_exit(jit, emit_jcc(jit, CC_Z), pc, -1);
+        emit8(jit, 0xFF); emit8(jit, 0xE0);
+    }
+}
+
+// Continues at the PC in eax
+void emit_chain_indirect(struct jit* jit, int* flag) {
+    emit_flags(jit, flag);
+    // mov rcx, [rbx + rax * 8]; test rcx, rcx; jz exit; jmp rcx
+    emit_rex(jit, 1, RCX, 0, RBX);
+    emit8(jit, 0x8B);
+    emit_modrm_mem(jit, RCX, RBX, RAX, 8, 0);
+    emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xC9);
+    patch_rel32(emit_jcc(jit, CC_Z), jit->exit);
+    emit8(jit, 0xFF); emit8(jit, 0xE1);
+}
+
+// Store checks shared by ST/STR/STI, the address is in eax. Stores into the device page or over
+//  translated or analysed code are left to mem_write. The device check is left out for stores
+//  known to miss every device.
+void emit_store_checks(struct jit* jit, uint16_t pc, int flag, int device_check) {
+    if (device_check) {
+        // cmp eax, JIT_DEVICE_PAGE; jae exit
+        emit8(jit, 0x3D);
+        emit32(jit, JIT_DEVICE_PAGE);
+        add_exit(jit, emit_jcc(jit, CC_AE), pc | JIT_SIDE_EXIT, flag);
+    }
+    // test byte [rbp + rax], CODE_TRANSLATED | CODE_ANALYZED; jnz exit
+    emit8(jit, 0xF6);
+    emit_modrm_mem(jit, 0, RBP, RAX, 1, 0);
+    emit8(jit, CODE_TRANSLATED | CODE_ANALYZED);
+    add_exit(jit, emit_jcc(jit, CC_NZ), pc | JIT_SIDE_EXIT, flag);
+}
+
+void emit_load_check(struct jit* jit, uint16_t pc, int flag) {
+    emit8(jit, 0x3D);
+    emit32(jit, JIT_DEVICE_PAGE);
+    add_exit(jit, emit_jcc(jit, CC_AE), pc | JIT_SIDE_EXIT, flag);
+}
+
+
+void jit_write_stubs(struct jit* jit) {
+    // uint32_t enter(reg, memory, entry, code_map, target)
+    jit->enter = (jit_enter_fn)jit->code;
+    emit8(jit, 0x53);                                       // push rbx
+    emit8(jit, 0x55);                                       // push rbp
+    emit8(jit, 0x41); emit8(jit, 0x54);                     // push r12
+    emit8(jit, 0x41); emit8(jit, 0x55);                     // push r13
+    emit8(jit, 0x41); emit8(jit, 0x56);                     // push r14
+    emit8(jit, 0x41); emit8(jit, 0x57);                     // push r15
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xD3);   // mov rbx, rdx
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xCD);   // mov rbp, rcx
+    emit8(jit, 0x4C); emit8(jit, 0x89); emit8(jit, 0xC0);   // mov rax, r8
+    for (int r = R_R0; r <= R_R7; ++r) {
+        emit_load16(jit, HOST(r), RDI, -1, 1, r * 2);
+    }
+    // edx = a value with the same flags as reg[R_COND]: 1 for P, 0 for Z, 0x8000 for N
+    emit_load16(jit, RCX, RDI, -1, 1, R_COND * 2);
+    emit8(jit, 0x31); emit8(jit, 0xD2);                     // xor edx, edx
+    emit8(jit, 0x83); emit8(jit, 0xF9); emit8(jit, FL_POS); // cmp ecx, FL_POS
+    emit8(jit, 0x75); emit8(jit, 0x05);                     // jne +5
+    emit_mov32_ri(jit, RDX, 1);
+    emit8(jit, 0x83); emit8(jit, 0xF9); emit8(jit, FL_NEG); // cmp ecx, FL_NEG
+    emit8(jit, 0x75); emit8(jit, 0x05);                     // jne +5
+    emit_mov32_ri(jit, RDX, 0x8000);
+    emit8(jit, 0xFF); emit8(jit, 0xE0);                     // jmp rax
+
+    // Common exit: eax is the value to return, its low 16 bits the next PC
+    jit->exit = jit->code;
+    emit_store16(jit, RAX, RDI, -1, 1, R_PC * 2);
+    emit_mov32_ri(jit, RCX, FL_ZRO);
+    emit_test16(jit, RDX);
+    emit8(jit, 0x74); emit8(jit, 0x0C);                     // jz +12
+    emit_mov32_ri(jit, RCX, FL_POS);
+    emit8(jit, 0x79); emit8(jit, 0x05);                     // jns +5
+    emit_mov32_ri(jit, RCX, FL_NEG);
+    emit_store16(jit, RCX, RDI, -1, 1, R_COND * 2);
+    for (int r = R_R0; r <= R_R7; ++r) {
+        emit_store16(jit, HOST(r), RDI, -1, 1, r * 2);
+    }
+    emit8(jit, 0x41); emit8(jit, 0x5F);                     // pop r15
+    emit8(jit, 0x41); emit8(jit, 0x5E);                     // pop r14
+    emit8(jit, 0x41); emit8(jit, 0x5D);                     // pop r13
+    emit8(jit, 0x41); emit8(jit, 0x5C);                     // pop r12
+    emit8(jit, 0x5D);                                       // pop rbp
+    emit8(jit, 0x5B);                                       // pop rbx
+    emit8(jit, 0xC3);                                       // ret
+
+    jit->blocks_start = jit->code;
+}
+
+int jit_init(struct vm* vm) {
+    if (vm->jit) {
+        return 1;
+    }
+    struct jit* jit = calloc(1, sizeof(struct jit));
+    if (!jit) {
+        return 0;
+    }
+    void* buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        free(jit);
+        return 0;
+    }
+    jit->buffer = buffer;
+    jit->code = jit->buffer;
+    jit_write_stubs(jit);
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+        free(jit);
+        return 0;
+    }
+    vm->jit = jit;
+    return 1;
+}
+
+void jit_destroy(struct vm* vm) {
+    if (vm->jit) {
+        munmap(vm->jit->buffer, JIT_BUFFER_SIZE);
+        free(vm->jit);
+        vm->jit = NULL;
+    }
+}
+
+void jit_flush(struct vm* vm) {
+    struct jit* jit = vm->jit;
+    for (int i = 0; i < jit->count; ++i) {
+        uint16_t addr = jit->starts[i];
+        jit->entry[addr] = NULL;
+        jit->hits[addr] = 0;
+        if (jit->flushes[addr] < JIT_MAX_FLUSHES) {
+            ++jit->flushes[addr];
+        }
+        for (int n = 0; n < jit->lengths[i]; ++n) {
+            vm->code_map[addr++] &= ~CODE_TRANSLATED;
+        }
+    }
+    jit->count = 0;
+    jit->code = jit->blocks_start;
+}
+
+
+// TRAP, RTI and RES are left to the interpreter in run_jit(), and so are calls and returns while
+//  vm->calls follows them: jsr() and jmp() keep the call stack
+int jit_interprets(struct vm* vm, const struct decoded* d) {
+    if (d->id == D_TRAP || d->id == D_RTI || d->id == D_RES) {
+        return 1;
+    }
+    return vm->calls && (d->id == D_JSR || d->id == D_JSRR || (d->id == D_JMP && d->r1 == R_R7));
+}
+
+// Compiles the block starting at start. Returns NULL when there is nothing worth compiling
+void* jit_compile(struct vm* vm, uint16_t start) {
+    struct jit* jit = vm->jit;
+    if (start >= JIT_DEVICE_PAGE) {
+        return NULL;
+    }
+    // A block that would start with an instruction left to the interpreter compiles to nothing,
+    //  find out before paying for the two mprotect() calls. Loops around a trap come here again
+    //  every JIT_THRESHOLD entries.
+    struct decoded first;
+    decode_instruction(&first, start, vm->memory[start]);
+    if (jit_interprets(vm, &first)) {
+        return NULL;
+    }
+    if (jit->count == JIT_MAX_BLOCKS || jit->code + JIT_MAX_BLOCK_CODE > jit->buffer + JIT_BUFFER_SIZE) {
+        jit_flush(vm);
+    }
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+
+    uint8_t* block = jit->code;
+    uint16_t pc = start;
+    int length = 0;
+    int flag = -1;
+    int done = 0;
+    jit->exit_count = 0;
+
+    // Leave through an exit that is not a side exit once the budget has to be looked at. It is
+    //  taken before anything is counted, and run_jit() calls budget_check() before coming back.
+    // mov rax, [rdi + instructions]; cmp rax, [rdi + check_at]; jae exit
+    emit_rex(jit, 1, RAX, 0, RDI);
+    emit8(jit, 0x8B);
+    emit_modrm_mem(jit, RAX, RDI, -1, 1, offsetof(struct vm, instructions));
+    emit_rex(jit, 1, RAX, 0, RDI);
+    emit8(jit, 0x3B);
+    emit_modrm_mem(jit, RAX, RDI, -1, 1, offsetof(struct vm, check_at));
+    add_exit(jit, emit_jcc(jit, CC_AE), start, -1);
+
+    // The block counts all of its instructions up front, the length is patched in at the end
+    uint8_t* count = emit_count(jit, 0, 0);
+
+    while (!done) {
+        if (pc >= JIT_DEVICE_PAGE) {
+            emit_side_exit(jit, pc, &flag);
+            break;
+        }
+        if (length == JIT_MAX_LENGTH) {
+            emit_chain(jit, pc, block, start, &flag);
+            break;
+        }
+
+        struct decoded d;
+        decode_instruction(&d, pc, vm->memory[pc]);
+        int dr = HOST(d.r0);
+        int sr1 = HOST(d.r1);
+        int sr2 = HOST(d.r2);
+        uint16_t next_pc = pc + 1;
+
+        if (jit_interprets(vm, &d)) {
+            if (length == 0) {
+                jit->code = block;
+                mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+                return NULL;
+            }
+            emit_side_exit(jit, pc, &flag);
+            break;
+        }
+
+        switch (d.id) {
+            case D_ADD_REG:
+            case D_AND_REG: {
+                uint8_t opcode = d.id == D_ADD_REG ? 0x01 : 0x21;
+                if (d.r0 == d.r1) {
+                    emit_alu16_rr(jit, opcode, dr, sr2);
+                } else if (d.r0 == d.r2) {
+                    emit_alu16_rr(jit, opcode, dr, sr1);
+                } else {
+                    emit_mov32_rr(jit, dr, sr1);
+                    emit_alu16_rr(jit, opcode, dr, sr2);
+                }
+                flag = d.r0;
+                break;
+            }
+            case D_ADD_IMM:
+            case D_AND_IMM:
+                if (d.r0 != d.r1) {
+                    emit_mov32_rr(jit, dr, sr1);
+                }
+                emit_alu16_ri(jit, d.id == D_ADD_IMM ? 0 : 4, dr, (int8_t)(int16_t)d.imm);
+                flag = d.r0;
+                break;
+            case D_NOT:
+                if (d.r0 != d.r1) {
+                    emit_mov32_rr(jit, dr, sr1);
+                }
+                emit_not16(jit, dr);
+                flag = d.r0;
+                break;
+            case D_LEA:
+                emit_mov32_ri(jit, dr, d.imm);
+                flag = d.r0;
+                break;
+            case D_LD:
+                if (d.imm >= JIT_DEVICE_PAGE) {
+                    emit_side_exit(jit, pc, &flag);
+                    done = 1;
+                    continue;
+                }
+                emit_load16(jit, dr, RSI, -1, 1, d.imm * 2);
+                flag = d.r0;
+                break;
+            case D_LDR:
+                emit_address(jit, sr1, (int16_t)d.imm);
+                if (!(vm->code_map[pc] & CODE_NO_IO)) {
+                    emit_load_check(jit, pc, flag);
+                }
+                emit_load16(jit, dr, RSI, RAX, 2, 0);
+                flag = d.r0;
+                break;
+            case D_LDI:
+                if (d.imm >= JIT_DEVICE_PAGE) {
+                    emit_side_exit(jit, pc, &flag);
+                    done = 1;
+                    continue;
+                }
+                emit_load16(jit, RAX, RSI, -1, 1, d.imm * 2);
+                emit_load_check(jit, pc, flag);
+                emit_load16(jit, dr, RSI, RAX, 2, 0);
+                flag = d.r0;
+                break;
+            case D_ST:
+                emit_mov32_ri(jit, RAX, d.imm);
+                emit_store_checks(jit, pc, flag, d.imm >= JIT_DEVICE_PAGE);
+                emit_store16(jit, dr, RSI, RAX, 2, 0);
+                break;
+            case D_STR:
+                emit_address(jit, sr1, (int16_t)d.imm);
+                emit_store_checks(jit, pc, flag, !(vm->code_map[pc] & CODE_NO_IO));
+                emit_store16(jit, dr, RSI, RAX, 2, 0);
+                break;
+            case D_STI:
+                if (d.imm >= JIT_DEVICE_PAGE) {
+                    emit_side_exit(jit, pc, &flag);
+                    done = 1;
+                    continue;
+                }
+                emit_load16(jit, RAX, RSI, -1, 1, d.imm * 2);
+                emit_store_checks(jit, pc, flag, 1);
+                emit_store16(jit, dr, RSI, RAX, 2, 0);
+                break;
+            case D_BR: {
+                int mask = d.r0;
+                if (mask == 0) {
+                    emit_chain(jit, next_pc, block, start, &flag);
+                } else if (mask == (FL_NEG | FL_ZRO | FL_POS)) {
+                    // reg[R_COND] is never 0 inside compiled code, see run_jit()
+                    emit_chain(jit, d.imm, block, start, &flag);
+                } else {
+                    static const int conditions[8] = {
+                        [FL_POS] = CC_G, [FL_ZRO] = CC_Z, [FL_ZRO | FL_POS] = CC_NS,
+                        [FL_NEG] = CC_S, [FL_NEG | FL_POS] = CC_NZ, [FL_NEG | FL_ZRO] = CC_LE
+                    };
+                    emit_flags(jit, &flag);
+                    emit_test16(jit, RDX);
+                    uint8_t* taken = emit_jcc(jit, conditions[mask]);
+                    emit_chain(jit, next_pc, block, start, &flag);
+                    patch_rel32(taken, jit->code);
+                    emit_chain(jit, d.imm, block, start, &flag);
+                }
+                done = 1;
+                break;
+            }
+            case D_JSR:
+                emit_flags(jit, &flag);
+                emit_mov32_ri(jit, HOST(R_R7), next_pc);
+                emit_chain(jit, d.imm, block, start, &flag);
+                done = 1;
+                break;
+            case D_JSRR:
+                // R7 is written first, same as jsr(), so JSRR R7 falls through
+                emit_flags(jit, &flag);
+                if (d.r1 == R_R7) {
+                    emit_mov32_ri(jit, HOST(R_R7), next_pc);
+                    emit_chain(jit, next_pc, block, start, &flag);
+                } else {
+                    emit_mov32_rr(jit, RAX, sr1);
+                    emit_mov32_ri(jit, HOST(R_R7), next_pc);
+                    emit_chain_indirect(jit, &flag);
+                }
+                done = 1;
+                break;
+            case D_JMP:
+                emit_mov32_rr(jit, RAX, sr1);
+                emit_chain_indirect(jit, &flag);
+                done = 1;
+                break;
+            default:
+                // Everything else is in jit_interprets()
+                abort();
+        }
+        mark_code(vm, pc, CODE_TRANSLATED);
+        pc = next_pc;
+        ++length;
+    }
+
+    // Out of line exits for the checks above. Side exits leave before the instruction at their PC,
+    //  so they take back the instructions that did not run
+    for (int i = 0; i < jit->exit_count; ++i) {
+        struct jit_exit* e = &jit->exits[i];
+        patch_rel32(e->patch, jit->code);
+        if (e->value & JIT_SIDE_EXIT) {
+            emit_count(jit, 5, length - (uint16_t)(e->value - start));
+        }
+        emit_flags(jit, &e->flag);
+        emit_mov32_ri(jit, RAX, e->value);
+        emit_jmp_to(jit, jit->exit);
+    }
+
+    uint32_t counted = length;
+    memcpy(count, &counted, sizeof(counted));
+    mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+    if (length == 0) {
+        jit->code = block;
+        return NULL;
+    }
+
+    jit->starts[jit->count] = start;
+    jit->lengths[jit->count] = length;
+    ++jit->count;
+    jit->entry[start] = block;
+    return block;
+}
+
+
+void run_jit(struct vm* vm) {
+    if (!jit_init(vm)) {
+        printf("Failed to allocate the JIT code buffer\n");
+        run_switch(vm);
+        return;
+    }
+    struct jit* jit = vm->jit;
+
+    while (vm->running && CHECKPOINT(vm)) {
+        uint16_t pc = vm->reg[R_PC];
+        void* code = jit->entry[pc];
+
+        // Compiled code assumes a flag has been set, which is only false before the first
+        //  flag setting instruction
+        if (cond_flags(vm)) {
+            if (!code && jit->flushes[pc] < JIT_MAX_FLUSHES && ++jit->hits[pc] >= JIT_THRESHOLD) {
+                code = jit_compile(vm, pc);
+                if (!code) {
+                    jit->hits[pc] = 0;
+                }
+            }
+            if (code) {
+                // Compiled code reads and writes reg[R_COND] itself
+                sync_flags(vm);
+                uint32_t exit = jit->enter(vm->reg, vm->memory, jit->entry, vm->code_map, code);
+                if (!(exit & JIT_SIDE_EXIT)) {
+                    continue;
+                }
+            }
+        }
+
+        // Interpret up to and including the next control transfer
+        uint16_t op;
+        do {
+            uint16_t instruction = mem_fetch(vm, vm->reg[R_PC]++);
+            ++vm->instructions;
+            op = instruction >> 12;
+            execute(vm, instruction);
+        } while (vm->running && op != OP_BR && op != OP_JMP && op != OP_JSR && op != OP_TRAP);
+    }
+}
+#endif
+/****************************************************************************************************
+ *                                    End of x86-64 JIT                                             *
+ ***************************************************************************************************/
+
+
+int parse_engine(const char* name) {
+    for (int i = 0; i < ENGINE_COUNT; ++i) {
+        if (strcmp(name, engine_names[i]) == 0) {
+#ifndef HAVE_COMPUTED_GOTO
+            if (i == ENGINE_THREADED || i == ENGINE_BLOCK) {
+                return -1;
+            }
+#endif
+#ifndef HAVE_JIT
+            if (i == ENGINE_JIT) {
+                return -1;
+            }
+#endif
+#ifndef HAVE_HANDLER_TABLE
+            if (i == ENGINE_TABLE) {
+                return -1;
+            }
+#endif
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// The engines with check-free loads and stores. A profiled run goes through run_profiled() and
+//  checks every access whatever the engine.
+int uses_analysis(struct vm* vm, int engine) {
+    return !vm->profile && (engine == ENGINE_DECODED || engine == ENGINE_BLOCK || engine == ENGINE_JIT);
+}
+
+void run(struct vm* vm, int engine) {
+    if (vm->flush_policy == FLUSH_AUTO) {
+        vm->flush_policy = isatty(fileno(vm->output)) ? FLUSH_IMMEDIATE : FLUSH_SIZE;
+    }
+    budget_start(vm);
+    vm->memory[MR_MCR] |= MCR_CLOCK_ENABLE;
+    if (vm->calls) {
+        vm->calls->root.routine = vm->reg[R_PC];
+        vm->calls->depth = 0;
+        if (vm->calls->graph) {
+            call_graph_start(vm->calls, vm->instructions);
+        }
+    }
+    // Before the first instruction changes anything
+    if (!vm->analyzed && uses_analysis(vm, engine)) {
+        analyze_code(vm);
+    }
+
+    if (vm->profile || vm->calls) {
+        profiled_vm = vm;
+    }
+
+    // Profiling needs every instruction to go through one loop, whatever the engine
+    if (vm->profile) {
+        run_profiled(vm);
+    } else {
+        switch (engine) {
+#ifdef HAVE_COMPUTED_GOTO
+            case ENGINE_THREADED:
+                run_threaded(vm);
+                break;
+            case ENGINE_BLOCK:
+                run_blocks(vm);
+                break;
+#endif
+            case ENGINE_DECODED:
+                run_decoded(vm);
+                break;
+#ifdef HAVE_JIT
+            case ENGINE_JIT:
+                run_jit(vm);
+                break;
+#endif
+#ifdef HAVE_HANDLER_TABLE
+            case ENGINE_TABLE:
+                run_table(vm);
+                break;
+#endif
+            default:
+                run_switch(vm);
+                break;
+        }
+    }
+    profiled_vm = NULL;
+    if (vm->calls && vm->calls->graph) {
+        call_graph_finish(vm->calls, vm->instructions);
+    }
+    sync_flags(vm);
+    console_flush(vm);
+}
+/****************************************************************************************************
+ *                                  End of Execution Engines                                        *
+ ***************************************************************************************************/
+
+
+/****************************************************************************************************
+ *                                   Start of Static Analysis                                       *
+ ***************************************************************************************************/
+// analyze_code() walks the code reachable from the PC before the first instruction runs. It keeps
+//  a range of possible values for every register and proves which LDR/STR can never reach a device
+//  page. The decoded, block and jit engines give those a memory access without the bus lookup. The
+//  analysis is sound or it proves nothing:
+//  - every register starts out unknown. A load, a trap reading a key, or a return from a call
+//    make their register unknown again, except LD from a word no store can write.
+//  - JSR/JSRR leave a return address tag in R7, and JMP through a tagged R7 is a return. The
+//    instruction after every call is reached with every register unknown.
+//  - any other JMP or JSRR to an address that is not known exactly, or code on a device page,
+//    gives up on the whole image.
+//  - a counted loop, a straight run of code closed by ADD Rc, Rc, #-1 and BRp back to its start,
+//    runs at most Rc times. Registers it steps by a constant stay within that many steps of the
+//    values they came in with.
+//  Which words can be written is only known once every store has been analysed. The analysis
+//  starts out assuming no word is written and runs again whenever a store turns out to reach a
+//  word it read as a constant. When anything is proven, every word reached is marked CODE_ANALYZED,
+//  and a store to one drops every proof, see drop_analysis().
+enum {
+    ANALYSIS_WIDEN_AFTER = 8,               // Joins into a word before its ranges are widened
+    ANALYSIS_MAX_STEPS   = 1 << 22,         // Gives up on images that take longer than this
+    ANALYSIS_MAX_ROUNDS  = 8,
+    ANALYSIS_MAX_LOOP    = 64               // Longest counted loop
+};
+
+// Every value the register can hold lies in [lo, hi], unless ret is set: then it holds the return
+//  address of some JSR/JSRR that was analysed
+struct value_range {
+    uint16_t lo;
+    uint16_t hi;
+    uint8_t ret;
+};
+
+struct analysis_state {
+    struct value_range reg[8];
+};
+
+// Bits in analysis.marks
+enum analysis_marks {
+    MARK_QUEUED      = 1 << 0,
+    MARK_JUMPED_INTO = 1 << 1,              // Reached other than from the word before
+    MARK_CONSTANT    = 1 << 2,              // Read as a constant, by LD or for the address of STI
+    MARK_WRITTEN     = 1 << 3               // Some store can write the word, kept across rounds
+};
+
+struct analysis {
+    struct analysis_state* states;          // On entry to every word
+    uint8_t* visits;                        // Joins into the word, 0 while it is not reached
+    uint8_t* marks;                         // enum analysis_marks
+    uint16_t* loop_end;                     // The BRp closing a counted loop that starts here, or 0
+    uint16_t* worklist;
+    int pending;
+    int rerun;                              // The round has to be done again
+};
+
+static const struct value_range unknown_value = { 0, 0xFFFF, 0 };
+
+static inline struct value_range exact_value(uint16_t value) {
+    struct value_range v = { value, value, 0 };
+    return v;
+}
+
+// Modulo 1 << 16, unknown when the sum wraps part of the way round
+struct value_range add_ranges(struct value_range a, struct value_range b) {
+    if (a.ret || b.ret) {
+        return unknown_value;
+    }
+    uint32_t lo = (uint32_t)a.lo + b.lo;
+    uint32_t hi = (uint32_t)a.hi + b.hi;
+    if ((lo >> 16) != (hi >> 16)) {
+        return unknown_value;
+    }
+    struct value_range v = { (uint16_t)lo, (uint16_t)hi, 0 };
+    return v;
+}
+
+// x & y is never more than either of them
+struct value_range and_ranges(struct value_range a, struct value_range b) {
+    if (a.ret || b.ret) {
+        return unknown_value;
+    }
+    if (a.lo == a.hi && b.lo == b.hi) {
+        return exact_value(a.lo & b.lo);
+    }
+    struct value_range v = { 0, a.hi < b.hi ? a.hi : b.hi, 0 };
+    return v;
+}
+
+struct value_range not_range(struct value_range a) {
+    if (a.ret) {
+        return unknown_value;
+    }
+    struct value_range v = { (uint16_t)~a.hi, (uint16_t)~a.lo, 0 };
+    return v;
+}
+
+// Widening jumps a bound that keeps moving straight to the edge of the memory below or above the
+//  device pages, so loops settle in a few rounds
+uint16_t widen_low(uint16_t old, uint16_t value) {
+    if (value >= old) {
+        return old;
+    }
+    for (int page = (old >> BUS_PAGE_SHIFT) - 1; page >= 0; --page) {
+        if (bus[page] && (page + 1) * BUS_PAGE_SIZE <= value) {
+            return (page + 1) * BUS_PAGE_SIZE;
+        }
+    }
+    return 0;
+}
+
+uint16_t widen_high(uint16_t old, uint16_t value) {
+    if (value <= old) {
+        return old;
+    }
+    for (int page = (old >> BUS_PAGE_SHIFT) + 1; page < BUS_PAGES; ++page) {
+        if (bus[page] && page * BUS_PAGE_SIZE > value) {
+            return page * BUS_PAGE_SIZE - 1;
+        }
+    }
+    return 0xFFFF;
+}
+
+// The register an instruction writes, or -1
+int written_register(const struct decoded* d) {
+    switch (d->id) {
+        case D_ADD_REG:
+        case D_ADD_IMM:
+        case D_AND_REG:
+        case D_AND_IMM:
+        case D_NOT:
+        case D_LEA:
+        case D_LD:
+        case D_LDR:
+        case D_LDI:
+            return d->r0;
+        case D_JSR:
+        case D_JSRR:
+            return R_R7;
+        default:
+            return -1;
+    }
+}
+
+// Finds every BRp at b back to some h <= b with ADD Rc, Rc, #-1 right before it and, from h on,
+//  no other control transfer and no other write to Rc. Whether anything jumps into the middle is
+//  only known after a round, see check_loops().
+void find_counted_loops(struct vm* vm, struct analysis* an) {
+    for (int b = 1; b < MEMORY_MAX; ++b) {
+        uint16_t branch = vm->memory[b];
+        uint16_t count = vm->memory[b - 1];
+        if (branch >> 12 != OP_BR || ((branch >> 9) & 0x7) != FL_POS ||
+            count >> 12 != OP_ADD || ((count >> 9) & 0x7) != ((count >> 6) & 0x7) ||
+            (count & 0x3F) != 0x3F) {
+            continue;
+        }
+        uint16_t h = b + 1 + sign_extend(branch & 0x1FF, 9);
+        if (h >= b || b - h > ANALYSIS_MAX_LOOP || an->loop_end[h]) {
+            continue;
+        }
+        int counter = (count >> 9) & 0x7;
+        int straight = 1;
+        for (uint16_t pc = h; straight && pc < b - 1; ++pc) {
+            struct decoded d;
+            decode_instruction(&d, pc, vm->memory[pc]);
+            straight = !ends_block(d.id) && written_register(&d) != counter;
+        }
+        if (straight) {
+            an->loop_end[h] = b;
+        }
+    }
+}
+
+// The state a word is run with: the one it is entered with, or for the start of a counted loop
+//  the one that holds on every trip round it
+void entry_state(struct vm* vm, struct analysis* an, uint16_t h, struct analysis_state* s) {
+    *s = an->states[h];
+    uint16_t b = an->loop_end[h];
+    if (!b) {
+        return;
+    }
+    int counter = (vm->memory[b - 1] >> 9) & 0x7;
+    int32_t step[8] = { 0 };
+    int written = 0;
+    int varies = 0;
+    for (uint16_t pc = h; pc < b; ++pc) {
+        struct decoded d;
+        decode_instruction(&d, pc, vm->memory[pc]);
+        int r = written_register(&d);
+        if (r < 0) {
+            continue;
+        }
+        written |= 1 << r;
+        if (d.id == D_ADD_IMM && d.r1 == r) {
+            step[r] += (int16_t)d.imm;
+        } else {
+            varies |= 1 << r;
+        }
+    }
+
+    // A count of n > 0 comes round n times, anything else once, unless the decrement takes it
+    //  from negative to positive
+    struct value_range count = s->reg[counter];
+    int bounded = !count.ret && count.hi <= 0x7FFF;
+    int32_t trips = count.hi > 1 ? count.hi : 1;
+    for (int r = 0; r < 8; ++r) {
+        struct value_range v = s->reg[r];
+        if (!(written & (1 << r))) {
+            continue;
+        }
+        if (!bounded || v.ret || (varies & (1 << r))) {
+            s->reg[r] = unknown_value;
+        } else if (r == counter) {
+            s->reg[r].lo = v.lo < 1 ? v.lo : 1;
+        } else {
+            int32_t span = step[r] * (trips - 1);
+            int32_t lo = v.lo + (span < 0 ? span : 0);
+            int32_t hi = v.hi + (span > 0 ? span : 0);
+            if (lo < 0 || hi > 0xFFFF) {
+                s->reg[r] = unknown_value;
+            } else {
+                s->reg[r].lo = lo;
+                s->reg[r].hi = hi;
+            }
+        }
+    }
+}
+
+// Returns whether the state at addr changed
+int join_state(struct analysis* an, uint16_t addr, const struct analysis_state* in) {
+    struct analysis_state* s = &an->states[addr];
+    if (!an->visits[addr]) {
+        *s = *in;
+        an->visits[addr] = 1;
+        return 1;
+    }
+    int widen = an->visits[addr] > ANALYSIS_WIDEN_AFTER;
+    int changed = 0;
+    for (int r = 0; r < 8; ++r) {
+        struct value_range old = s->reg[r];
+        struct value_range v = in->reg[r];
+        if (old.ret && v.ret) {
+            continue;
+        }
+        if (old.ret || v.ret) {
+            v = unknown_value;
+        } else if (widen) {
+            v.lo = widen_low(old.lo, v.lo);
+            v.hi = widen_high(old.hi, v.hi);
+        } else {
+            v.lo = v.lo < old.lo ? v.lo : old.lo;
+            v.hi = v.hi > old.hi ? v.hi : old.hi;
+        }
+        if (v.lo != old.lo || v.hi != old.hi || v.ret != old.ret) {
+            s->reg[r] = v;
+            changed = 1;
+        }
+    }
+    if (changed && an->visits[addr] < UINT8_MAX) {
+        ++an->visits[addr];
+    }
+    return changed;
+}
+
+void flow_to(struct analysis* an, uint16_t from, uint16_t to, const struct analysis_state* in) {
+    if (an->loop_end[to] == from && from) {
+        // Going round a counted loop again is covered by entry_state()
+        return;
+    }
+    if ((uint16_t)(from + 1) != to) {
+        an->marks[to] |= MARK_JUMPED_INTO;
+    }
+    if (join_state(an, to, in) && !(an->marks[to] & MARK_QUEUED)) {
+        an->marks[to] |= MARK_QUEUED;
+        an->worklist[an->pending++] = to;
+    }
+}
+
+void flow_to_unknown(struct analysis* an, uint16_t from, uint16_t to) {
+    struct analysis_state s;
+    for (int r = 0; r < 8; ++r) {
+        s.reg[r] = unknown_value;
+    }
+    flow_to(an, from, to, &s);
+}
+
+// Follows a call to target. Returns 0 when the target is not known exactly
+int flow_call(struct analysis* an, uint16_t pc, struct value_range target, struct analysis_state* s) {
+    if (target.ret || target.lo != target.hi) {
+        return 0;
+    }
+    s->reg[R_R7].ret = 1;
+    flow_to(an, pc, target.lo, s);
+    flow_to_unknown(an, pc, pc + 1);
+    return 1;
+}
+
+// A word read as the value it holds now, or -1 if a store or a device may change it
+int32_t constant_word(struct vm* vm, struct analysis* an, uint16_t addr) {
+    if (bus[addr >> BUS_PAGE_SHIFT] || (an->marks[addr] & MARK_WRITTEN)) {
+        return -1;
+    }
+    an->marks[addr] |= MARK_CONSTANT;
+    return vm->memory[addr];
+}
+
+// Runs the instruction at pc on the state it is entered with and passes the result on to every
+//  word it can go to next. Returns 0 to give up.
+int analyze_step(struct vm* vm, struct analysis* an, uint16_t pc) {
+    if (bus[pc >> BUS_PAGE_SHIFT]) {
+        return 0;
+    }
+    struct analysis_state s;
+    entry_state(vm, an, pc, &s);
+    struct decoded d;
+    decode_instruction(&d, pc, vm->memory[pc]);
+    uint16_t next = pc + 1;
+
+    switch (d.id) {
+        case D_ADD_REG:
+            s.reg[d.r0] = add_ranges(s.reg[d.r1], s.reg[d.r2]);
+            break;
+        case D_ADD_IMM:
+            s.reg[d.r0] = add_ranges(s.reg[d.r1], exact_value(d.imm));
+            break;
+        case D_AND_REG:
+            s.reg[d.r0] = and_ranges(s.reg[d.r1], s.reg[d.r2]);
+            break;
+        case D_AND_IMM:
+            s.reg[d.r0] = and_ranges(s.reg[d.r1], exact_value(d.imm));
+            break;
+        case D_NOT:
+            s.reg[d.r0] = not_range(s.reg[d.r1]);
+            break;
+        case D_LEA:
+            s.reg[d.r0] = exact_value(d.imm);
+            break;
+        case D_LD: {
+            int32_t value = constant_word(vm, an, d.imm);
+            s.reg[d.r0] = value < 0 ? unknown_value : exact_value(value);
+            break;
+        }
+        case D_LDR:
+        case D_LDI:
+            s.reg[d.r0] = unknown_value;
+            break;
+        case D_ST:
+        case D_STR:
+        case D_STI:
+            break;
+        case D_BR:
+            // The condition codes are not followed, both ways can be taken
+            if (d.r0) {
+                flow_to(an, pc, d.imm, &s);
+            }
+            break;
+        case D_JSR:
+            s.reg[R_R7] = exact_value(next);
+            return flow_call(an, pc, exact_value(d.imm), &s);
+        case D_JSRR: {
+            // R7 is written first, same as jsr()
+            struct value_range target = d.r1 == R_R7 ? exact_value(next) : s.reg[d.r1];
+            s.reg[R_R7] = exact_value(next);
+            return flow_call(an, pc, target, &s);
+        }
+        case D_JMP: {
+            struct value_range target = s.reg[d.r1];
+            if (target.ret) {
+                // A return, the word after the call is reached from the call itself
+                return 1;
+            }
+            if (target.lo != target.hi) {
+                return 0;
+            }
+            flow_to(an, pc, target.lo, &s);
+            return 1;
+        }
+        case D_TRAP:
+            if (d.imm == TRAP_HALT) {
+                return 1;
+            }
+            // GETC and IN read a key into R0, the other traps leave the registers alone
+            s.reg[R_R0] = unknown_value;
+            break;
+        default:
+            // RTI and RES stop the process
+            return 1;
+    }
+    flow_to(an, pc, next, &s);
+    return 1;
+}
+
+void mark_written(struct analysis* an, struct value_range v) {
+    for (int addr = v.lo; addr <= v.hi; ++addr) {
+        if ((an->marks[addr] & (MARK_CONSTANT | MARK_WRITTEN)) == MARK_CONSTANT) {
+            an->rerun = 1;
+        }
+        an->marks[addr] |= MARK_WRITTEN;
+    }
+}
+
+// After a round: every word a store can reach is written from now on, and a counted loop that
+//  something jumps into the middle of is not one. Either may call for another round.
+void check_round(struct vm* vm, struct analysis* an) {
+    for (int pc = 0; pc < MEMORY_MAX; ++pc) {
+        if (!an->visits[pc]) {
+            continue;
+        }
+        struct analysis_state s;
+        entry_state(vm, an, pc, &s);
+        struct decoded d;
+        decode_instruction(&d, pc, vm->memory[pc]);
+        if (d.id == D_ST) {
+            mark_written(an, exact_value(d.imm));
+        } else if (d.id == D_STR) {
+            mark_written(an, add_ranges(s.reg[d.r1], exact_value(d.imm)));
+        } else if (d.id == D_STI) {
+            int32_t target = constant_word(vm, an, d.imm);
+            mark_written(an, target < 0 ? unknown_value : exact_value(target));
+        }
+
+        uint16_t b = an->loop_end[pc];
+        for (uint16_t m = pc + 1; b && m <= b; ++m) {
+            if (an->marks[m] & MARK_JUMPED_INTO) {
+                an->loop_end[pc] = 0;
+                an->rerun = 1;
+                break;
+            }
+        }
+    }
+}
+
+// Whether base + offset can land on a device page, for a base in the range v
+int may_reach_device(struct value_range v, uint16_t offset) {
+    struct value_range address = add_ranges(v, exact_value(offset));
+    for (int page = address.lo >> BUS_PAGE_SHIFT; page <= address.hi >> BUS_PAGE_SHIFT; ++page) {
+        if (bus[page]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// One pass of the worklist from the PC, returns 0 to give up
+int analyze_round(struct vm* vm, struct analysis* an) {
+    memset(an->visits, 0, MEMORY_MAX);
+    for (int addr = 0; addr < MEMORY_MAX; ++addr) {
+        an->marks[addr] &= MARK_CONSTANT | MARK_WRITTEN;
+    }
+    an->pending = 0;
+    an->rerun = 0;
+    flow_to_unknown(an, vm->reg[R_PC], vm->reg[R_PC]);
+    for (int steps = 0; an->pending; ++steps) {
+        uint16_t pc = an->worklist[--an->pending];
+        an->marks[pc] &= ~MARK_QUEUED;
+        if (steps == ANALYSIS_MAX_STEPS || !analyze_step(vm, an, pc)) {
+            return 0;
+        }
+    }
+    check_round(vm, an);
+    return 1;
+}
+
+// Marks the LDR/STR reachable from the PC that can never reach a device with CODE_NO_IO, and then
+//  every word reached with CODE_ANALYZED. Returns the number proven, 0 when the analysis gave up.
+int analyze_code(struct vm* vm) {
+    struct analysis an;
+    an.states = malloc(MEMORY_MAX * sizeof(struct analysis_state));
+    an.visits = malloc(MEMORY_MAX);
+    an.marks = calloc(MEMORY_MAX, 1);
+    an.loop_end = calloc(MEMORY_MAX, sizeof(uint16_t));
+    an.worklist = malloc(MEMORY_MAX * sizeof(uint16_t));
+    vm->analyzed = 1;
+
+    int proven = 0;
+    int complete = 0;
+    if (an.states && an.visits && an.marks && an.loop_end && an.worklist) {
+        find_counted_loops(vm, &an);
+        for (int round = 0; round < ANALYSIS_MAX_ROUNDS; ++round) {
+            complete = analyze_round(vm, &an) && !an.rerun;
+            if (complete || !an.rerun) {
+                break;
+            }
+        }
+    }
+    for (int pc = 0; complete && pc < MEMORY_MAX; ++pc) {
+        struct decoded d;
+        if (!an.visits[pc]) {
+            continue;
+        }
+        decode_instruction(&d, pc, vm->memory[pc]);
+        if (d.id == D_LDR || d.id == D_STR) {
+            struct analysis_state s;
+            entry_state(vm, &an, pc, &s);
+            if (!may_reach_device(s.reg[d.r1], d.imm)) {
+                mark_code(vm, pc, CODE_NO_IO);
+                ++proven;
+            }
+        }
+    }
+    // Without a proof there is nothing for a store to code to drop
+    for (int pc = 0; proven && pc < MEMORY_MAX; ++pc) {
+        if (an.visits[pc]) {
+            mark_code(vm, pc, CODE_ANALYZED);
+        }
+    }
+    free(an.states);
+    free(an.visits);
+    free(an.marks);
+    free(an.loop_end);
+    free(an.worklist);
+    return proven;
+}
+
+// Called by invalidate_code() when a store hits a word analyze_code() took for code. Every proof
+//  may rest on the old word, so they all go, along with the decoded records and the blocks that
+//  were built on them.
+void drop_analysis(struct vm* vm) {
+    int flush = 0;
+    for (int addr = 0; addr < MEMORY_MAX; ++addr) {
+        uint8_t bits = vm->code_map[addr];
+        if ((bits & CODE_NO_IO) && (bits & CODE_DECODED)) {
+            vm->decoded[addr].id = D_UNDECODED;
+            bits &= ~CODE_DECODED;
+        }
+        if ((bits & CODE_NO_IO) && (bits & CODE_TRANSLATED)) {
+            flush = 1;
+        }
+        vm->code_map[addr] = bits & ~(CODE_ANALYZED | CODE_NO_IO);
+    }
+    if (flush) {
+        flush_blocks(vm);
+    }
+}
+
+// The form of a decoded load or store that skips the bus: LD and ST whose address is not on a
+//  device page, LDR and STR that analyze_code() has proven. Any other id comes back as it is.
+int ram_access_id(struct vm* vm, uint16_t addr, const struct decoded* d) {
+    switch (d->id) {
+        case D_LD:
+            return bus[d->imm >> BUS_PAGE_SHIFT] ? D_LD : D_LD_RAM;
+        case D_ST:
+            return bus[d->imm >> BUS_PAGE_SHIFT] ? D_ST : D_ST_RAM;
+        case D_LDR:
+            return vm->code_map[addr] & CODE_NO_IO ? D_LDR_RAM : D_LDR;
+        case D_STR:
+            return vm->code_map[addr] & CODE_NO_IO ? D_STR_RAM : D_STR;
+        default:
+            return d->id;
+    }
+}
+/****************************************************************************************************
+ *                                     End of Static Analysis                                       *
+ ***************************************************************************************************/
+
+
+/****************************************************************************************************
+ *                                     Start of Profiler                                            *
+ ***************************************************************************************************/
+// Reports go to stderr when no file is given ("-"), stdout belongs to the guest
+FILE* open_report(const char* path) {
+    return strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+}
+
+void close_report(FILE* report) {
+    if (report != stderr) {
+        fclose(report);
+    }
+}
+
+
+// The report groups the counts into blocks: runs of consecutive PCs executed the same number of
+//  times, cut after every control transfer. Only the hottest PROFILE_TOP blocks and branches
+//  are listed.
+enum { PROFILE_TOP = 20 };
+
+const char* opcode_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+// Indexed by the n, z and p bits of a BR
+const char* branch_names[8] = {"", "p", "z", "zp", "n", "np", "nz", "nzp"};
+
+struct profile_block {
+    uint16_t start;
+    uint16_t length;
+    uint64_t executed;              // Times the block was run
+};
+
+const struct profile* sorted_profile;
+
+int compare_block_cost(const void* a, const void* b) {
+    const struct profile_block* x = a;
+    const struct profile_block* y = b;
+    uint64_t cx = x->executed * x->length;
+    uint64_t cy = y->executed * y->length;
+    return cx < cy ? 1 : cx > cy ? -1 : x->start - y->start;
+}
+
+int compare_branch_count(const void* a, const void* b) {
+    uint16_t x = *(const uint16_t*)a;
+    uint16_t y = *(const uint16_t*)b;
+    uint64_t cx = sorted_profile->executed[x];
+    uint64_t cy = sorted_profile->executed[y];
+    return cx < cy ? 1 : cx > cy ? -1 : x - y;
+}
+
+// Writes the opcode mix, the hottest blocks and the hottest branches to vm->profile->report
+void profile_report(struct vm* vm) {
+    const struct profile* profile = vm->profile;
+    FILE* out = profile->report;
+    uint64_t total = 0;
+    for (int op = 0; op < 16; ++op) {
+        total += profile->opcodes[op];
+    }
+    double percent = total ? 100.0 / total : 0;
+
+    fprintf(out, "profile: %llu instructions\n\n", (unsigned long long)total);
+    fprintf(out, "opcode          executed        %%\n");
+    for (int op = 0; op < 16; ++op) {
+        if (profile->opcodes[op]) {
+            fprintf(out, "%-6s  %16llu  %6.2f\n", opcode_names[op],
+                    (unsigned long long)profile->opcodes[op], profile->opcodes[op] * percent);
+        }
+    }
+
+    // Both lists are at most one entry per word
+    struct profile_block* blocks = malloc(MEMORY_MAX * sizeof(struct profile_block));
+    uint16_t* branches = malloc(MEMORY_MAX * sizeof(uint16_t));
+    if (!blocks || !branches) {
+        free(blocks);
+        free(branches);
+        fflush(out);
+        return;
+    }
+    int block_count = 0;
+    int branch_count = 0;
+    for (uint32_t pc = 0; pc < MEMORY_MAX; ++pc) {
+        uint64_t executed = profile->executed[pc];
+        if (!executed) {
+            continue;
+        }
+        // Cut the same way as the block engine's blocks
+        struct profile_block* last = block_count ? &blocks[block_count - 1] : NULL;
+        struct decoded previous;
+        decode_instruction(&previous, pc - 1, vm->memory[pc - 1]);
+        if (last && last->start + last->length == pc && last->executed == executed &&
+            !ends_block(previous.id)) {
+            ++last->length;
+        } else {
+            blocks[block_count++] = (struct profile_block){pc, 1, executed};
+        }
+        if (vm->memory[pc] >> 12 == OP_BR) {
+            branches[branch_count++] = pc;
+        }
+    }
+    qsort(blocks, block_count, sizeof(struct profile_block), compare_block_cost);
+    sorted_profile = profile;
+    qsort(branches, branch_count, sizeof(uint16_t), compare_branch_count);
+
+    fprintf(out, "\nblock          instructions        %%        runs  length\n");
+    for (int i = 0; i < block_count && i < PROFILE_TOP; ++i) {
+        struct profile_block* b = &blocks[i];
+        uint64_t cost = b->executed * b->length;
+        fprintf(out, "x%04X-x%04X  %14llu  %6.2f  %10llu  %6d\n", b->start, b->start + b->length - 1,
+                (unsigned long long)cost, cost * percent, (unsigned long long)b->executed, b->length);
+    }
+
+    fprintf(out, "\nbranch           executed         taken     not taken\n");
+    for (int i = 0; i < branch_count && i < PROFILE_TOP; ++i) {
+        uint16_t pc = branches[i];
+        uint64_t taken = profile->taken[pc];
+        fprintf(out, "x%04X BR%-3s  %12llu  %12llu  %12llu\n", pc, branch_names[(vm->memory[pc] >> 9) & 0x7],
+                (unsigned long long)profile->executed[pc], (unsigned long long)taken,
+                (unsigned long long)(profile->executed[pc] - taken));
+    }
+    fflush(out);
+    free(blocks);
+    free(branches);
+}
+
+
+// Routine names for the reports, read from the .sym file next to an image
+struct symbols {
+    char* names[MEMORY_MAX];
+};
+
+// The image path with its extension replaced by .sym. Symbol lines look like "//	NAME  3008", the
+//  way LC-3 assemblers write them (the // is optional), anything else is skipped. Returns 0 if
+//  there is no such file.
+int read_symbols(struct symbols* symbols, const char* image) {
+    char path[4096];
+    const char* dot = strrchr(image, '.');
+    const char* slash = strrchr(image, '/');
+    int length = dot && (!slash || dot > slash) ? (int)(dot - image) : (int)strlen(image);
+    snprintf(path, sizeof(path), "%.*s.sym", length, image);
+
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        char* text = line;
+        while (*text == '/' || *text == ' ' || *text == '\t') {
+            ++text;
+        }
+        char name[256];
+        char address[16];
+        char extra;
+        if (sscanf(text, "%255s %15s %c", name, address, &extra) != 2) {
+            continue;
+        }
+        char* digits = address[0] == 'x' || address[0] == 'X' ? address + 1 : address;
+        char* end;
+        unsigned long value = strtoul(digits, &end, 16);
+        if (end == digits || *end || value >= MEMORY_MAX) {
+            continue;
+        }
+        free(symbols->names[value]);
+        symbols->names[value] = strdup(name);
+    }
+    fclose(file);
+    return 1;
+}
+
+void free_symbols(struct symbols* symbols) {
+    for (int i = 0; i < MEMORY_MAX; ++i) {
+        free(symbols->names[i]);
+    }
+    free(symbols);
+}
+
+// The name of addr, or its address when it has none. buffer must hold 6 characters
+const char* symbol_name(const struct symbols* symbols, uint16_t addr, char* buffer) {
+    if (symbols && symbols->names[addr]) {
+        return symbols->names[addr];
+    }
+    snprintf(buffer, 6, "x%04X", addr);
+    return buffer;
+}
+
+
+// --sample takes a sample of the guest's PC and call stack every 1/hz seconds of CPU time, from a
+//  SIGPROF handler. The handler only adds to a fixed hash table of distinct stacks, the vm does
+//  nothing extra besides following JSR/RET. Stacks deeper than SAMPLE_DEPTH keep their innermost
+//  frames.
+enum {
+    SAMPLE_DEPTH = 32,              // Frames kept per sample, the entry and the PC included
+    SAMPLE_SLOTS = 1 << 14
+};
+
+struct sample {
+    uint64_t count;                 // 0 for a free slot
+    int truncated;
+    int length;
+    uint16_t frames[SAMPLE_DEPTH];  // Entry, routines called, then the PC
+};
+
+struct sampler {
+    uint64_t dropped;               // Samples that found the table full
+    FILE* report;
+    struct symbols* symbols;        // Names frames in the report, may be NULL
+    struct sample table[SAMPLE_SLOTS];
+};
+
+// Only one sampler per process, SIGPROF has a single handler
+struct sampler* active_sampler;
+
+void sample_handler(int signal) {
+    (void)signal;
+    struct sampler* sampler = active_sampler;
+    struct vm* vm = profiled_vm;
+    if (!sampler || !vm || !vm->calls) {
+        return;
+    }
+    struct call_stack* calls = vm->calls;
+    int depth = calls->depth < CALL_STACK_MAX ? calls->depth : CALL_STACK_MAX;
+    atomic_signal_fence(memory_order_acquire);
+
+    struct sample key = {0};
+    int first = depth > SAMPLE_DEPTH - 2 ? depth - (SAMPLE_DEPTH - 2) : 0;
+    key.truncated = first > 0 || calls->depth > CALL_STACK_MAX;
+    key.frames[key.length++] = calls->root.routine;
+    for (int i = first; i < depth; ++i) {
+        key.frames[key.length++] = calls->frames[i].routine;
+    }
+    key.frames[key.length++] = vm->reg[R_PC];
+
+    // FNV-1a over the frames, then linear probing
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < key.length; ++i) {
+        hash = (hash ^ key.frames[i]) * 16777619u;
+    }
+    for (int probe = 0; probe < SAMPLE_SLOTS; ++probe) {
+        struct sample* slot = &sampler->table[(hash + probe) & (SAMPLE_SLOTS - 1)];
+        if (!slot->count) {
+            key.count = 1;
+            *slot = key;
+            return;
+        }
+        if (slot->length == key.length && slot->truncated == key.truncated &&
+            memcmp(slot->frames, key.frames, key.length * sizeof(uint16_t)) == 0) {
+            ++slot->count;
+            return;
+        }
+    }
+    ++sampler->dropped;
+}
+
+// Installs the handler and starts the profiling timer at hz (1 to 1000000) samples per second
+struct sampler* sampler_start(int hz, FILE* report) {
+    struct sampler* sampler = calloc(1, sizeof(struct sampler));
+    if (!sampler) {
+        return NULL;
+    }
+    sampler->report = report;
+    active_sampler = sampler;
+
+    // Restart the syscalls it interrupts, getc() on the keyboard must not see EINTR
+    struct sigaction action = {0};
+    action.sa_handler = sample_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    long interval = 1000000 / hz;
+    struct itimerval timer = {{interval / 1000000, interval % 1000000},
+                              {interval / 1000000, interval % 1000000}};
+    if (sigaction(SIGPROF, &action, NULL) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        active_sampler = NULL;
+        free(sampler);
+        return NULL;
+    }
+    return sampler;
+}
+
+void sampler_stop(struct sampler* sampler) {
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+    signal(SIGPROF, SIG_IGN);
+    active_sampler = NULL;
+    free(sampler);
+}
+
+// Writes the samples as folded stacks, "x3000;x3120;x3125 42" per line, the format flame graph
+//  tools read
+void sampler_report() {
+    struct sampler* sampler = active_sampler;
+    if (!sampler) {
+        return;
+    }
+    FILE* out = sampler->report;
+    for (int i = 0; i < SAMPLE_SLOTS; ++i) {
+        struct sample* sample = &sampler->table[i];
+        if (!sample->count) {
+            continue;
+        }
+        char buffer[6];
+        fprintf(out, "%s", symbol_name(sampler->symbols, sample->frames[0], buffer));
+        if (sample->truncated) {
+            fprintf(out, ";...");
+        }
+        for (int f = 1; f < sample->length; ++f) {
+            fprintf(out, ";%s", symbol_name(sampler->symbols, sample->frames[f], buffer));
+        }
+        fprintf(out, " %llu\n", (unsigned long long)sample->count);
+    }
+    fflush(out);
+    if (sampler->dropped) {
+        fprintf(stderr, "%llu samples dropped, too many distinct stacks\n",
+                (unsigned long long)sampler->dropped);
     }
-    for (int i = 0; i < argc; ++i) {
-        if (!read_image(argv[i])) {
-            printf("Failed to load image %s\n", argv[i]);
-            exit(1);
+}
+
+
+const struct call_graph* sorted_graph;
+
+int compare_routine_cost(const void* a, const void* b) {
+    const struct routine_cost* x = &sorted_graph->routines[*(const uint16_t*)a];
+    const struct routine_cost* y = &sorted_graph->routines[*(const uint16_t*)b];
+    return x->exclusive < y->exclusive ? 1 : x->exclusive > y->exclusive ? -1 :
+           *(const uint16_t*)a - *(const uint16_t*)b;
+}
+
+int compare_edge_cost(const void* a, const void* b) {
+    const struct call_edge* x = *(const struct call_edge* const*)a;
+    const struct call_edge* y = *(const struct call_edge* const*)b;
+    return x->inclusive < y->inclusive ? 1 : x->inclusive > y->inclusive ? -1 :
+           x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+// Writes every routine called, most exclusive instructions first, then every caller/callee pair,
+//  most inclusive instructions first
+void call_graph_report(struct call_graph* graph) {
+    FILE* out = graph->report;
+    uint16_t* routines = malloc(MEMORY_MAX * sizeof(uint16_t));
+    struct call_edge** edges = malloc(CALL_EDGE_SLOTS * sizeof(struct call_edge*));
+    if (!routines || !edges) {
+        free(routines);
+        free(edges);
+        return;
+    }
+    int routine_count = 0;
+    uint64_t total = 0;
+    double total_time = 0;
+    for (uint32_t addr = 0; addr < MEMORY_MAX; ++addr) {
+        if (graph->routines[addr].calls) {
+            routines[routine_count++] = addr;
+            total += graph->routines[addr].exclusive;
+            total_time += graph->routines[addr].exclusive_time;
+        }
+    }
+    int edge_count = 0;
+    for (int i = 0; i < CALL_EDGE_SLOTS; ++i) {
+        if (graph->edges[i].calls) {
+            edges[edge_count++] = &graph->edges[i];
         }
     }
+    sorted_graph = graph;
+    qsort(routines, routine_count, sizeof(uint16_t), compare_routine_cost);
+    qsort(edges, edge_count, sizeof(struct call_edge*), compare_edge_cost);
+    double percent = total ? 100.0 / total : 0;
 
-    // Initial Setup
-    signal(SIGINT, sigint_handler);
-    disable_input_buffering();
+    char buffer[2][6];
+    fprintf(out, "call graph: %llu instructions, %.3f s\n\n", (unsigned long long)total, total_time);
+    fprintf(out, "%-22s  %10s  %12s  %7s  %12s  %7s  %10s  %10s\n", "routine", "calls", "inclusive",
+            "%", "exclusive", "%", "incl (ms)", "excl (ms)");
+    for (int i = 0; i < routine_count; ++i) {
+        const struct routine_cost* cost = &graph->routines[routines[i]];
+        fprintf(out, "%-16.16s x%04X  %10llu  %12llu  %7.2f  %12llu  %7.2f  %10.3f  %10.3f\n",
+                symbol_name(graph->symbols, routines[i], buffer[0]), routines[i],
+                (unsigned long long)cost->calls, (unsigned long long)cost->inclusive,
+                cost->inclusive * percent, (unsigned long long)cost->exclusive,
+                cost->exclusive * percent, cost->inclusive_time * 1e3, cost->exclusive_time * 1e3);
+    }
 
-    // Set the PC to the starting position
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
+    fprintf(out, "\n%-16s  %-16s  %10s  %12s  %10s\n", "caller", "callee", "calls", "inclusive",
+            "incl (ms)");
+    for (int i = 0; i < edge_count; ++i) {
+        const struct call_edge* edge = edges[i];
+        fprintf(out, "%-16.16s  %-16.16s  %10llu  %12llu  %10.3f\n",
+                symbol_name(graph->symbols, edge->caller, buffer[0]),
+                symbol_name(graph->symbols, edge->callee, buffer[1]),
+                (unsigned long long)edge->calls, (unsigned long long)edge->inclusive,
+                edge->inclusive_time * 1e3);
+    }
+    if (graph->dropped) {
+        fprintf(out, "%llu calls between pairs that did not fit in the table\n",
+                (unsigned long long)graph->dropped);
+    }
+    fflush(out);
+    free(routines);
+    free(edges);
+}
+/****************************************************************************************************
+ *                                      End of Profiler                                             *
+ ***************************************************************************************************/
 
-    running = 1;
 
-    while(running) {
-        // Fetch an instruction
-        uint16_t instruction = mem_read(reg[R_PC]++);
-        uint16_t op = instruction >> 12;
+/****************************************************************************************************
+ *                                   Start of VM Lifecycle                                          *
+ ***************************************************************************************************/
+// Guest memory is always mmap'd: anonymous for a new vm, or a private mapping of an image file for
+//  a clone, so the kernel copies a page the first time the clone writes to it. Returns NULL on
+//  failure.
+uint16_t* map_memory(int fd, off_t offset) {
+    int flags = fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE;
+    void* memory = mmap(NULL, MEMORY_MAX * sizeof(uint16_t), PROT_READ | PROT_WRITE, flags, fd, offset);
+    return memory == MAP_FAILED ? NULL : memory;
+}
 
-        switch (op) {
-            case OP_BR:
-                br(instruction);
-                break;
-            case OP_ADD:
-                add(instruction);
-                break;
-            case OP_LD:
-                ld(instruction);
-                break;
-            case OP_ST:
-                st(instruction);
-                break;
-            case OP_JSR:
-                jsr(instruction);
-                break;
-            case OP_AND:
-                and(instruction);
-                break;
-            case OP_LDR:
-                ldr(instruction);
-                break;
-            case OP_STR:
-                str(instruction);
-                break;
-            case OP_RTI:
-                rti(instruction);
-                break;
-            case OP_NOT:
-                not(instruction);
-                break;
-            case OP_LDI:
-                ldi(instruction);
-                break;
-            case OP_STI:
-                sti(instruction);
-                break;
-            case OP_JMP:
-                jmp(instruction);
-                break;
-            case OP_RES:
-                res(instruction);
-                break;
-            case OP_LEA:
-                lea(instruction);
-                break;
-            case OP_TRAP:
-                trap(instruction);
-                break;
-            default:
-                // Bad Opcode
-                abort();
+// Wraps memory from map_memory() in a machine with the PC at PC_START, or returns NULL (and unmaps
+//  the memory) if it could not be allocated. The per-engine caches are only allocated by the
+//  engine that uses them.
+struct vm* vm_create_with_memory(uint16_t* memory) {
+    if (!memory) {
+        return NULL;
+    }
+    struct vm* vm = calloc(1, sizeof(struct vm));
+    uint8_t* code_map = calloc(MEMORY_MAX, sizeof(uint8_t));
+    char* console = malloc(CONSOLE_BUFFER_SIZE);
+    if (!vm || !code_map || !console) {
+        munmap(memory, MEMORY_MAX * sizeof(uint16_t));
+        free(console);
+        free(code_map);
+        free(vm);
+        return NULL;
+    }
+    vm->memory = memory;
+    vm->code_map = code_map;
+    vm->console = console;
+    vm->flags_result = FLAGS_SYNCED;
+    vm->reg[R_PC] = PC_START;
+    vm->input = stdin;
+    vm->output = stdout;
+    return vm;
+}
+
+// Returns a zeroed machine, or NULL if it could not be allocated
+struct vm* vm_create() {
+    return vm_create_with_memory(map_memory(-1, 0));
+}
+
+void vm_destroy(struct vm* vm) {
+#ifdef HAVE_JIT
+    jit_destroy(vm);
+#endif
+    free(vm->blocks);
+    free(vm->decoded);
+    free(vm->console);
+    free(vm->code_map);
+    munmap(vm->memory, MEMORY_MAX * sizeof(uint16_t));
+    free(vm);
+}
+
+
+// A loaded machine frozen in an unlinked file, to clone any number of vms from. Load the image
+//  into a vm once, then vm_image_create() it and vm_clone() the result; the clones share its
+//  memory copy-on-write.
+struct vm_image {
+    int fd;                         // MEMORY_MAX words
+    uint16_t reg[R_COUNT];
+    int analyzed;                   // The clones need no analyze_code() of their own
+    int code_count;                 // Words analyze_code() marked, handed to every clone
+    uint16_t* code;
+    uint8_t* code_bits;
+};
+
+int anonymous_file() {
+#ifdef __linux__
+    return memfd_create("lc3-image", 0);
+#else
+    FILE* file = tmpfile();
+    if (!file) {
+        return -1;
+    }
+    int fd = dup(fileno(file));
+    fclose(file);
+    return fd;
+#endif
+}
+
+// Returns NULL on failure. The vm is left as it was and can be destroyed straight away. engine is
+//  the one the clones will run, see uses_analysis().
+struct vm_image* vm_image_create(struct vm* vm, int engine) {
+    struct vm_image* image = malloc(sizeof(struct vm_image));
+    if (!image) {
+        return NULL;
+    }
+    image->fd = anonymous_file();
+    size_t size = MEMORY_MAX * sizeof(uint16_t);
+    if (image->fd < 0 || write(image->fd, vm->memory, size) != (ssize_t)size) {
+        if (image->fd >= 0) {
+            close(image->fd);
+        }
+        free(image);
+        return NULL;
+    }
+    sync_flags(vm);
+    memcpy(image->reg, vm->reg, sizeof(image->reg));
+
+    // Analysed once here rather than in every clone
+    if (!vm->analyzed && uses_analysis(vm, engine)) {
+        analyze_code(vm);
+    }
+    image->analyzed = vm->analyzed;
+    image->code_count = 0;
+    image->code = malloc(MEMORY_MAX * sizeof(uint16_t));
+    image->code_bits = malloc(MEMORY_MAX);
+    for (int addr = 0; image->code && image->code_bits && addr < MEMORY_MAX; ++addr) {
+        if (vm->code_map[addr] & (CODE_ANALYZED | CODE_NO_IO)) {
+            image->code[image->code_count] = addr;
+            image->code_bits[image->code_count++] = vm->code_map[addr] & (CODE_ANALYZED | CODE_NO_IO);
+        }
+    }
+    return image;
+}
+
+void vm_image_destroy(struct vm_image* image) {
+    close(image->fd);
+    free(image->code);
+    free(image->code_bits);
+    free(image);
+}
+
+// Returns a new vm in the state the image was frozen in, or NULL if it could not be allocated.
+//  Nothing is copied until the clone writes to its memory.
+struct vm* vm_clone(const struct vm_image* image) {
+    struct vm* vm = vm_create_with_memory(map_memory(image->fd, 0));
+    if (!vm) {
+        return NULL;
+    }
+    memcpy(vm->reg, image->reg, sizeof(vm->reg));
+    for (int i = 0; i < image->code_count; ++i) {
+        mark_code(vm, image->code[i], image->code_bits[i]);
+    }
+    vm->analyzed = image->analyzed;
+    return vm;
+}
+
+
+// A snapshot file is a header followed by memory[] exactly as it is in the vm (host byte order),
+//  at an offset that is a multiple of any page size, so resuming only has to map it privately
+//  like vm_clone() does. The keyboard latch lives in memory[MR_KBSR]/[MR_KBDR] and comes along.
+enum {
+    SNAPSHOT_VERSION     = 1,
+    SNAPSHOT_MEMORY_AT   = 1 << 16
+};
+
+struct snapshot_header {
+    char magic[8];                  // "LC3SNAP"
+    uint32_t version;
+    uint32_t memory_at;             // File offset of memory[]
+    uint16_t reg[R_COUNT];          // With the condition codes synced
+    uint64_t instructions;
+};
+
+// Writes to <path>.tmp and renames it over path, so vms still running on an older snapshot at
+//  that path keep the file they mapped. Returns 0 on failure.
+int vm_save_snapshot(struct vm* vm, const char* path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LC3SNAP", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.memory_at = SNAPSHOT_MEMORY_AT;
+    sync_flags(vm);
+    memcpy(header.reg, vm->reg, sizeof(header.reg));
+    header.instructions = vm->instructions;
+
+    size_t size = MEMORY_MAX * sizeof(uint16_t);
+    int saved = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                pwrite(fd, vm->memory, size, SNAPSHOT_MEMORY_AT) == (ssize_t)size;
+    if (close(fd) != 0 || !saved || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+// Returns a vm in the state the snapshot was saved in, or NULL if the file is not a snapshot or
+//  the vm could not be allocated. Nothing is read from the file until the guest touches it.
+struct vm* vm_load_snapshot(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct snapshot_header header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, "LC3SNAP", 8) != 0 ||
+        header.version != SNAPSHOT_VERSION ||
+        header.memory_at % sysconf(_SC_PAGESIZE) != 0 ||
+        fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < header.memory_at + MEMORY_MAX * sizeof(uint16_t)) {
+        close(fd);
+        return NULL;
+    }
+    // The mapping keeps the file alive
+    struct vm* vm = vm_create_with_memory(map_memory(fd, header.memory_at));
+    close(fd);
+    if (!vm) {
+        return NULL;
+    }
+    memcpy(vm->reg, header.reg, sizeof(vm->reg));
+    vm->instructions = header.instructions;
+    return vm;
+}
+/****************************************************************************************************
+ *                                     End of VM Lifecycle                                          *
+ ***************************************************************************************************/
+
+
+/****************************************************************************************************
+ *                                   Start of Batch Runner                                          *
+ ***************************************************************************************************/
+// --batch=<manifest> runs many programs in one process. Every line of the manifest is a job,
+//  "<image> [<input file>]", run on a fresh vm with the input file as its keyboard and its console
+//  written to <output dir>/job-<line>.out. Jobs are dealt out to one deque per worker thread; a
+//  worker takes its own jobs from the back and, once it runs dry, steals from the front of the
+//  others. Nothing is shared between workers while jobs run, their statistics are merged at the end.
+// Every distinct image is loaded once up front and each job runs on a clone of it.
+struct batch_job {
+    int line;                       // In the manifest, names the output file
+    char* image;
+    char* input;                    // NULL for no input
+    struct vm_image* loaded;        // Shared by all the jobs with the same image, NULL if it failed
+    const char* error;              // Why the job could not run, NULL if it did
+    int stop;                       // The limit that stopped it, see enum stop_reasons
+    uint16_t stop_pc;
+    uint64_t instructions;
+    double latency;                 // Seconds from picking the job up to tearing its vm down
+};
+
+struct batch_worker {
+    pthread_t thread;
+    int started;
+    struct batch* batch;
+    int id;
+
+    // This worker's share of the jobs, as indices into batch->jobs. The owner pops from the back,
+    //  thieves take from the front
+    pthread_mutex_t lock;
+    int* deque;
+    int head;
+    int tail;
+
+    // Statistics, only written by the worker itself
+    int jobs;
+    int stolen;
+    uint64_t instructions;
+    double busy;
+};
+
+struct batch {
+    struct batch_job* jobs;
+    int job_count;
+    struct batch_worker* workers;
+    int worker_count;
+    struct vm_image** images;       // One per distinct image
+    int image_count;
+    int engine;
+    int flush_policy;
+    struct limits limits;           // Applied to every job on its own
+    const char* output_dir;
+};
+
+
+// Reads the manifest into batch->jobs. Blank lines and lines starting with # are skipped
+int read_manifest(struct batch* batch, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    char line[4096];
+    int capacity = 0;
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        ++line_number;
+        char* image = strtok(line, " \t\r\n");
+        if (!image || image[0] == '#') {
+            continue;
+        }
+        char* input = strtok(NULL, " \t\r\n");
+
+        if (batch->job_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct batch_job* jobs = realloc(batch->jobs, capacity * sizeof(struct batch_job));
+            if (!jobs) {
+                fclose(file);
+                return 0;
+            }
+            batch->jobs = jobs;
+        }
+        struct batch_job* job = &batch->jobs[batch->job_count++];
+        memset(job, 0, sizeof(*job));
+        job->line = line_number;
+        job->image = strdup(image);
+        job->input = input ? strdup(input) : NULL;
+    }
+    fclose(file);
+    return 1;
+}
+
+
+void batch_run_job(struct batch* batch, struct batch_job* job) {
+    double start = now_seconds();
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/job-%d.out", batch->output_dir, job->line);
+
+    if (!job->loaded) {
+        job->error = "failed to load the image";
+        return;
+    }
+    struct vm* vm = vm_clone(job->loaded);
+    if (!vm) {
+        job->error = "failed to allocate the vm";
+        return;
+    }
+    vm->input = fopen(job->input ? job->input : "/dev/null", "r");
+    vm->output = fopen(path, "w");
+    if (vm->output) {
+        // The console buffer already hands over large chunks, each goes out as one write(2)
+        setvbuf(vm->output, NULL, _IONBF, 0);
+    }
+    vm->flush_policy = batch->flush_policy;
+    vm->limits = batch->limits;
+    if (!vm->input) {
+        job->error = "failed to open the input file";
+    } else if (!vm->output) {
+        job->error = "failed to create the output file";
+    } else {
+        // Input files are mapped and read in place, stdio is only left for pipes and devices
+        vm->keyboard_map = input_map_open(fileno(vm->input));
+        vm->running = 1;
+        run(vm, batch->engine);
+        job->instructions = vm->instructions;
+        job->stop = vm->stop;
+        job->stop_pc = vm->reg[R_PC];
+    }
+
+    if (vm->keyboard_map) {
+        input_map_close(vm->keyboard_map);
+    }
+    if (vm->input) {
+        fclose(vm->input);
+    }
+    if (vm->output) {
+        fclose(vm->output);
+    }
+    vm_destroy(vm);
+    job->latency = now_seconds() - start;
+}
+
+
+int compare_job_images(const void* a, const void* b) {
+    const struct batch_job* x = *(struct batch_job* const*)a;
+    const struct batch_job* y = *(struct batch_job* const*)b;
+    return strcmp(x->image, y->image);
+}
+
+// Loads every distinct image in the manifest once and points its jobs at it
+int batch_load_images(struct batch* batch) {
+    struct batch_job** sorted = malloc(batch->job_count * sizeof(struct batch_job*));
+    batch->images = malloc(batch->job_count * sizeof(struct vm_image*));
+    if (!sorted || !batch->images) {
+        free(sorted);
+        return 0;
+    }
+    for (int i = 0; i < batch->job_count; ++i) {
+        sorted[i] = &batch->jobs[i];
+    }
+    qsort(sorted, batch->job_count, sizeof(struct batch_job*), compare_job_images);
+
+    struct vm_image* image = NULL;
+    for (int i = 0; i < batch->job_count; ++i) {
+        if (i == 0 || strcmp(sorted[i]->image, sorted[i - 1]->image) != 0) {
+            image = NULL;
+            struct vm* vm = vm_create();
+            if (vm && read_image(vm, sorted[i]->image)) {
+                image = vm_image_create(vm, batch->engine);
+            }
+            if (vm) {
+                vm_destroy(vm);
+            }
+            if (image) {
+                batch->images[batch->image_count++] = image;
+            }
+        }
+        sorted[i]->loaded = image;
+    }
+    free(sorted);
+    return 1;
+}
+
+
+// Returns the index of the next job for worker w, or -1 once every deque is empty. Jobs never
+//  create more jobs, so empty deques stay empty.
+int batch_next_job(struct batch_worker* w) {
+    int job = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        job = w->deque[--w->tail];
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (job >= 0) {
+        return job;
+    }
+
+    for (int i = 1; i < w->batch->worker_count && job < 0; ++i) {
+        struct batch_worker* victim = &w->batch->workers[(w->id + i) % w->batch->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            job = victim->deque[victim->head++];
+            ++w->stolen;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return job;
+}
+
+void* batch_worker(void* arg) {
+    struct batch_worker* w = arg;
+    int index;
+    while ((index = batch_next_job(w)) >= 0) {
+        struct batch_job* job = &w->batch->jobs[index];
+        batch_run_job(w->batch, job);
+        ++w->jobs;
+        w->instructions += job->instructions;
+        w->busy += job->latency;
+    }
+    return NULL;
+}
+
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of n sorted values
+double percentile(const double* sorted, int n, int p) {
+    int rank = (n * p + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+
+int run_batch(const char* manifest, const char* output_dir, int threads, int engine, int flush_policy,
+              struct limits limits) {
+    struct batch batch = {0};
+    batch.engine = engine;
+    batch.flush_policy = flush_policy;
+    batch.limits = limits;
+    batch.output_dir = output_dir;
+
+    if (!read_manifest(&batch, manifest)) {
+        printf("Failed to read manifest %s\n", manifest);
+        return 1;
+    }
+    if (batch.job_count == 0) {
+        printf("No jobs in manifest %s\n", manifest);
+        return 1;
+    }
+    if (mkdir(output_dir, 0777) != 0 && errno != EEXIST) {
+        printf("Failed to create output directory %s\n", output_dir);
+        return 1;
+    }
+    if (!batch_load_images(&batch)) {
+        printf("Failed to allocate the batch images\n");
+        return 1;
+    }
+
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > batch.job_count) {
+        threads = batch.job_count;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    batch.worker_count = threads;
+    batch.workers = calloc(threads, sizeof(struct batch_worker));
+    int* deques = malloc(batch.job_count * sizeof(int));
+    if (!batch.workers || !deques) {
+        printf("Failed to allocate the batch workers\n");
+        return 1;
+    }
+
+    // Deal the jobs out in contiguous runs, in manifest order
+    int dealt = 0;
+    for (int i = 0; i < threads; ++i) {
+        struct batch_worker* w = &batch.workers[i];
+        int share = batch.job_count / threads + (i < batch.job_count % threads);
+        w->batch = &batch;
+        w->id = i;
+        w->deque = deques + dealt;
+        w->head = 0;
+        w->tail = share;
+        for (int n = 0; n < share; ++n) {
+            // The owner pops from the back, so store its run reversed to start with the first job
+            w->deque[n] = dealt + share - 1 - n;
+        }
+        dealt += share;
+        pthread_mutex_init(&w->lock, NULL);
+    }
+
+    double start = now_seconds();
+    for (int i = 1; i < threads; ++i) {
+        // If a thread can not be started, whatever it was dealt gets stolen by the others
+        batch.workers[i].started =
+            pthread_create(&batch.workers[i].thread, NULL, batch_worker, &batch.workers[i]) == 0;
+    }
+    batch_worker(&batch.workers[0]);
+    for (int i = 1; i < threads; ++i) {
+        if (batch.workers[i].started) {
+            pthread_join(batch.workers[i].thread, NULL);
+        }
+    }
+    double wall = now_seconds() - start;
+
+    // Merge the per worker statistics
+    int jobs = 0;
+    uint64_t instructions = 0;
+    printf("thread      jobs  stolen    instructions    busy (s)\n");
+    for (int i = 0; i < threads; ++i) {
+        struct batch_worker* w = &batch.workers[i];
+        printf("%6d  %8d  %6d  %14llu  %10.3f\n", i, w->jobs, w->stolen,
+               (unsigned long long)w->instructions, w->busy);
+        jobs += w->jobs;
+        instructions += w->instructions;
+        pthread_mutex_destroy(&w->lock);
+    }
+
+    int failed = 0;
+    double* latencies = malloc(batch.job_count * sizeof(double));
+    for (int i = 0; i < batch.job_count; ++i) {
+        struct batch_job* job = &batch.jobs[i];
+        if (job->error) {
+            printf("job %d (%s): %s\n", job->line, job->image, job->error);
+            ++failed;
+        } else if (job->stop) {
+            printf("job %d (%s): %s reached at PC x%04X\n", job->line, job->image,
+                   stop_names[job->stop], job->stop_pc);
+            ++failed;
+        }
+        if (latencies) {
+            latencies[i] = job->latency;
+        }
+    }
+
+    printf("\n");
+    printf("jobs:          %d (%d failed)\n", jobs, failed);
+    printf("threads:       %d\n", threads);
+    printf("instructions:  %llu\n", (unsigned long long)instructions);
+    printf("wall time:     %.3f s\n", wall);
+    printf("throughput:    %.1f MIPS\n", wall > 0 ? instructions / wall / 1e6 : 0.0);
+    if (latencies) {
+        qsort(latencies, batch.job_count, sizeof(double), compare_doubles);
+        printf("latency p50:   %.3f ms\n", percentile(latencies, batch.job_count, 50) * 1e3);
+        printf("latency p99:   %.3f ms\n", percentile(latencies, batch.job_count, 99) * 1e3);
+    }
+
+    for (int i = 0; i < batch.job_count; ++i) {
+        free(batch.jobs[i].image);
+        free(batch.jobs[i].input);
+    }
+    for (int i = 0; i < batch.image_count; ++i) {
+        vm_image_destroy(batch.images[i]);
+    }
+    free(batch.images);
+    free(latencies);
+    free(deques);
+    free(batch.workers);
+    free(batch.jobs);
+    return failed ? 1 : 0;
+}
+/****************************************************************************************************
+ *                                     End of Batch Runner                                          *
+ ***************************************************************************************************/
+
+// Goes to stderr, stdout belongs to the guest
+void report_stop(struct vm* vm) {
+    fprintf(stderr, "\n%s reached at PC x%04X after %llu instructions\n", stop_names[vm->stop],
+            vm->reg[R_PC], (unsigned long long)vm->instructions);
+}
+
+// --save-snapshot-at-halt. A run cut short by a limit is not saved: --resume would carry on in the
+//  middle of whatever the limit stopped, not after a HALT
+void save_snapshot_at_halt(struct vm* vm, const char* path) {
+    if (vm->stop) {
+        fprintf(stderr, "No snapshot saved to %s, the program did not halt\n", path);
+    } else if (!vm_save_snapshot(vm, path)) {
+        printf("Failed to save snapshot %s\n", path);
+    }
+}
+
+// Shows the usage string, for a missing image or an unknown option
+void usage() {
+    printf("lc3-vm [--engine=switch|threaded|decoded|block|jit|table] [--flush=auto|immediate|line|size] [--headless] [image-file1] ...\n");
+    printf("lc3-vm [--engine=...] [--resume=<snapshot>] [--save-snapshot-at-halt=<snapshot>] [image-file1] ...\n");
+    printf("lc3-vm [--engine=...] --clones=<n> [image-file1] ...\n");
+    printf("lc3-vm [--engine=...] --batch=<manifest> [--batch-out=<dir>] [--threads=<n>]\n");
+    printf("limits: [--max-instructions=<n>] [--max-seconds=<s>] [--max-output=<bytes>]\n");
+    printf("profiling: [--profile[=<report file>]] [--sample[=<folded stacks file>]] [--sample-hz=<n>]\n");
+    printf("           [--callgraph[=<report file>]] [--stats]\n");
+    exit(2);
+}
+
+int main(int argc, const char* argv[]) {
+    int engine = DEFAULT_ENGINE;
+    const char* manifest = NULL;
+    const char* batch_out = ".";
+    int threads = 0;
+    int clones = 0;
+    const char* resume = NULL;
+    const char* save_snapshot = NULL;
+    int flush_policy = FLUSH_AUTO;
+    int headless = !isatty(STDIN_FILENO);
+    struct limits limits = {0};
+    int stop = STOP_NONE;
+    const char* profile_path = NULL;
+    const char* sample_path = NULL;
+    const char* callgraph_path = NULL;
+    struct symbols* symbols = NULL;
+    int stats = 0;
+    uint64_t executed = 0;
+    int sample_hz = 1000;
+    struct sampler* sampler = NULL;
+    int images = 0;
+
+    // Load Args
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--engine=", 9) == 0) {
+            engine = parse_engine(argv[i] + 9);
+            if (engine < 0) {
+                printf("Unknown engine %s\n", argv[i] + 9);
+                exit(2);
+            }
+        } else if (strncmp(argv[i], "--flush=", 8) == 0) {
+            flush_policy = parse_flush_policy(argv[i] + 8);
+            if (flush_policy < 0) {
+                printf("Unknown flush policy %s\n", argv[i] + 8);
+                exit(2);
+            }
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            manifest = argv[i] + 8;
+        } else if (strncmp(argv[i], "--batch-out=", 12) == 0) {
+            batch_out = argv[i] + 12;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--clones=", 9) == 0) {
+            clones = atoi(argv[i] + 9);
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = 1;
+        } else if (strncmp(argv[i], "--resume=", 9) == 0) {
+            resume = argv[i] + 9;
+        } else if (strncmp(argv[i], "--save-snapshot-at-halt=", 24) == 0) {
+            save_snapshot = argv[i] + 24;
+        } else if (strncmp(argv[i], "--max-instructions=", 19) == 0) {
+            limits.instructions = strtoull(argv[i] + 19, NULL, 10);
+        } else if (strncmp(argv[i], "--max-seconds=", 14) == 0) {
+            limits.seconds = atof(argv[i] + 14);
+        } else if (strncmp(argv[i], "--max-output=", 13) == 0) {
+            limits.output = strtoull(argv[i] + 13, NULL, 10);
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile_path = "-";
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile_path = argv[i] + 10;
+        } else if (strcmp(argv[i], "--sample") == 0) {
+            sample_path = "-";
+        } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+            sample_path = argv[i] + 9;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--callgraph") == 0) {
+            callgraph_path = "-";
+        } else if (strncmp(argv[i], "--callgraph=", 12) == 0) {
+            callgraph_path = argv[i] + 12;
+        } else if (strncmp(argv[i], "--sample-hz=", 12) == 0) {
+            sample_hz = atoi(argv[i] + 12);
+            if (sample_hz < 1 || sample_hz > 1000000) {
+                printf("Bad sampling rate %s\n", argv[i] + 12);
+                exit(2);
+            }
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Unknown option %s\n", argv[i]);
+            usage();
+        } else {
+            ++images;
+        }
+    }
+    // Without an image there is nothing to run, unless a snapshot or a manifest provides it
+    if (images == 0 && !resume && !manifest) {
+        usage();
+    }
+
+    // Batch mode never touches the terminal
+    if (manifest) {
+        return run_batch(manifest, batch_out, threads, engine, flush_policy, limits);
+    }
+
+    // A resumed vm carries on from where its snapshot was saved, any images are loaded over it
+    struct vm* vm = resume ? vm_load_snapshot(resume) : vm_create();
+    if (!vm) {
+        if (resume) {
+            printf("Failed to resume from snapshot %s\n", resume);
+        } else {
+            printf("Failed to allocate the vm\n");
+        }
+        exit(1);
+    }
+    vm->flush_policy = flush_policy;
+    vm->limits = limits;
+    if (profile_path) {
+        vm->profile = calloc(1, sizeof(struct profile));
+        if (!vm->profile) {
+            printf("Failed to allocate the profile\n");
+            exit(1);
+        }
+        vm->profile->report = open_report(profile_path);
+        if (!vm->profile->report) {
+            printf("Failed to create profile report %s\n", profile_path);
+            exit(1);
+        }
+    }
+    if (sample_path || callgraph_path) {
+        vm->calls = calloc(1, sizeof(struct call_stack));
+        symbols = calloc(1, sizeof(struct symbols));
+        if (!vm->calls || !symbols) {
+            printf("Failed to allocate the call stack\n");
+            exit(1);
+        }
+    }
+    if (sample_path) {
+        FILE* report = open_report(sample_path);
+        if (!report) {
+            printf("Failed to create sample report %s\n", sample_path);
+            exit(1);
+        }
+        sampler = sampler_start(sample_hz, report);
+        if (!sampler) {
+            printf("Failed to start the sampling timer\n");
+            exit(1);
+        }
+        sampler->symbols = symbols;
+    }
+    if (callgraph_path) {
+        vm->calls->graph = calloc(1, sizeof(struct call_graph));
+        if (!vm->calls->graph) {
+            printf("Failed to allocate the call graph\n");
+            exit(1);
+        }
+        vm->calls->graph->report = open_report(callgraph_path);
+        if (!vm->calls->graph->report) {
+            printf("Failed to create call graph report %s\n", callgraph_path);
+            exit(1);
+        }
+        vm->calls->graph->symbols = symbols;
+    }
+    // Every image is loaded at its own origin, later ones overwrite earlier ones where they overlap
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            continue;
+        }
+        if (!read_image(vm, argv[i])) {
+            printf("Failed to load image %s\n", argv[i]);
+            exit(1);
+        }
+        if (symbols) {
+            read_symbols(symbols, argv[i]);
+        }
+    }
+
+    // Initial Setup. Headless runs (stdin is not a terminal, or --headless) leave the terminal
+    //  alone and let SIGINT kill the process as usual
+    if (!headless) {
+        signal(SIGINT, sigint_handler);
+        disable_input_buffering();
+    } else {
+        if (vm->profile || vm->calls) {
+            // Still write the reports when interrupted
+            signal(SIGINT, sigint_handler);
+        }
+        // The console buffer already hands over large chunks, each goes out as one write(2)
+        setvbuf(stdout, NULL, _IONBF, 0);
+    }
+
+    // A file on stdin is mapped and read in place, anything else is drained by the reader thread.
+    //  Without either the keyboard falls back to select() and getc() on stdin.
+    struct input_map* keyboard_map = input_map_open(STDIN_FILENO);
+    struct input_ring* keyboard = keyboard_map ? NULL : input_ring_start(STDIN_FILENO);
+    vm->keyboard = keyboard;
+    vm->keyboard_map = keyboard_map;
+
+    double started = now_seconds();
+    if (clones > 0) {
+        // Run the loaded program again and again, each time on a fresh copy-on-write clone
+        struct vm_image* image = vm_image_create(vm, engine);
+        if (!image) {
+            if (!headless) {
+                restore_input_buffering();
+            }
+            printf("Failed to create the image to clone\n");
+            exit(1);
+        }
+        for (int i = 0; i < clones; ++i) {
+            struct vm* clone = vm_clone(image);
+            if (!clone) {
+                printf("Failed to clone the vm\n");
                 break;
+            }
+            clone->flush_policy = flush_policy;
+            clone->limits = limits;
+            clone->profile = vm->profile;
+            clone->calls = vm->calls;
+            clone->keyboard = keyboard;
+            clone->keyboard_map = keyboard_map;
+            clone->running = 1;
+            uint64_t before = clone->instructions;
+            run(clone, engine);
+            executed += clone->instructions - before;
+            if (clone->stop) {
+                report_stop(clone);
+                stop = clone->stop;
+            }
+            // The template vm never runs, the last clone is the one that halted
+            if (save_snapshot && i == clones - 1) {
+                save_snapshot_at_halt(clone, save_snapshot);
+            }
+            vm_destroy(clone);
+        }
+        vm_image_destroy(image);
+    } else {
+        // vm_create already put the PC at the starting position
+        vm->running = 1;
+        uint64_t before = vm->instructions;
+        run(vm, engine);
+        executed += vm->instructions - before;
+        if (vm->stop) {
+            report_stop(vm);
+            stop = vm->stop;
         }
     }
 
-    restore_input_buffering();
+    double elapsed = now_seconds() - started;
+    if (stats) {
+        // Machine readable, bench/bench.py parses it
+        fprintf(stderr, "instructions: %llu\nseconds: %.6f\nMIPS: %.1f\n", (unsigned long long)executed,
+                elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+    }
+
+    if (keyboard) {
+        input_ring_stop(keyboard);
+    }
+    if (keyboard_map) {
+        input_map_close(keyboard_map);
+    }
+    if (!headless) {
+        restore_input_buffering();
+    }
+    if (vm->profile) {
+        profile_report(vm);
+        close_report(vm->profile->report);
+        free(vm->profile);
+    }
+    if (sampler) {
+        sampler_report();
+        close_report(sampler->report);
+        sampler_stop(sampler);
+    }
+    if (vm->calls) {
+        if (vm->calls->graph) {
+            call_graph_report(vm->calls->graph);
+            close_report(vm->calls->graph->report);
+            free(vm->calls->graph);
+        }
+        free(vm->calls);
+        free_symbols(symbols);
+    }
+    if (save_snapshot && clones <= 0) {
+        save_snapshot_at_halt(vm, save_snapshot);
+    }
+    vm_destroy(vm);
+    // A run stopped by a limit exits with 2 + its enum stop_reasons: 3, 4 or 5
+    return stop ? 2 + stop : 0;
 }